@@ -36,9 +36,11 @@
 #include <spl.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
+#include "opt-A2.h"
 #include "opt-A3.h"
 
 /* in exception.S */
@@ -197,6 +199,23 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+#if OPT_A2
+		/*
+		 * A thread looping in user mode only comes through
+		 * here; if its process is exiting or execing (see
+		 * proc_exitcheck) it must go now. The unlocked peek keeps the common
+		 * case cheap. To leave it needs to be an ordinary
+		 * kernel thread again, so resync the interrupt state
+		 * as for the other traps below.
+		 */
+		if (!iskern && curproc != NULL &&
+		    (curproc->exiting || curproc->execThread != NULL)) {
+			spl = splhigh();
+			splx(spl);
+			proc_exitcheck();
+		}
+#endif
 		goto done2;
 	}
 
@@ -317,6 +336,13 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+#if OPT_A2
+	/* Another thread may have called _exit meanwhile. */
+	if (!iskern) {
+		proc_exitcheck();
+	}
+#endif
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
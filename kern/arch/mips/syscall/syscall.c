@@ -34,6 +34,7 @@
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <syscall.h>
 #include "opt-A2.h"
 
@@ -135,9 +136,36 @@ syscall(struct trapframe *tf)
 	  err = sys_fork((pid_t *)&retval, tf);
 	  break;
 
+	case SYS_vfork:
+	  err = sys_vfork((pid_t *)&retval, tf);
+	  break;
+
 	case SYS_execv:
 	  err = sys_execv((const_userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
 	  break;
+
+	case SYS_settickets:
+	  err = sys_settickets((pid_t)tf->tf_a0, (int)tf->tf_a1, &retval);
+	  break;
+
+	case SYS_setaffinity:
+	  err = sys_setaffinity((pid_t)tf->tf_a0, (uint32_t)tf->tf_a1);
+	  break;
+
+	case SYS_getrusage:
+	  err = sys_getrusage((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+	  break;
+
+	case SYS___threadfork:
+	  err = sys___threadfork((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+				 tf);
+	  break;
+
+	case SYS___threadexit:
+	  sys___threadexit();
+	  /* sys___threadexit does not return either */
+	  panic("unexpected return from sys___threadexit");
+	  break;
 #endif
 
 #endif // UW
@@ -191,7 +219,8 @@ syscall(struct trapframe *tf)
 void
 enter_forked_process(void *tf, unsigned long data2)
 {	
-  (void)data2;
+  // data2 is the user stack slot the parent thread was on
+  curthread->t_ustack = (int)data2;
   // parent trap frame, put on new stack, kernel stack of child
   struct trapframe *ttf = tf;
   struct trapframe t;
@@ -205,6 +234,24 @@ enter_forked_process(void *tf, unsigned long data2)
   t.tf_epc += 4;
   mips_usermode(&t);
 } 
+
+/*
+ * Enter user mode in a thread made by __threadfork. TF is set up to
+ * start at the thread's entry point (so, unlike fork, no epc += 4)
+ * and DATA2 is its user stack slot.
+ */
+void
+enter_new_thread(void *tf, unsigned long data2)
+{
+  struct trapframe t;
+
+  curthread->t_ustack = (int)data2;
+  t = *(struct trapframe *)tf;
+  kfree(tf);
+  // don't start at all if the process is already on its way out
+  proc_exitcheck();
+  mips_usermode(&t);
+}
 #else
 void
 enter_forked_process(struct trapframe *tf){
@@ -33,10 +33,13 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <proc.h>
+#include <cpu.h>
 #include <current.h>
+#include <thread.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <shrinker.h>
 #include "opt-A3.h"
 
 /*
@@ -47,10 +50,18 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
+/*
+ * Thread stacks are the same size and sit directly below the main
+ * one: slot i covers the STACKSIZE bytes below TSTACKTOP(i).
+ */
+#define DUMBVM_STACKSIZE     (DUMBVM_STACKPAGES * PAGE_SIZE)
+#define TSTACKTOP(i)         (USERSTACK - ((i) + 1) * DUMBVM_STACKSIZE)
+#define TSTACKBASE           TSTACKTOP(AS_NTHREADSTACKS)
+
 /*
  * Wrap rma_stealmem in a spinlock.
  */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+static struct spinlock stealmem_lock = SPINLOCK_TICKET_INITIALIZER;
 
 struct coreMap{
 	paddr_t addr;
@@ -97,7 +108,7 @@ vm_bootstrap(void)
 
 static
 paddr_t
-getppages(unsigned long npages)
+coremap_getppages(unsigned long npages)
 {
 	paddr_t addr;
 
@@ -135,10 +146,7 @@ getppages(unsigned long npages)
 		}
 //		kprintf("Test!\n");
 	} else {
-		kprintf("out of memory!\n");
 		addr = 0;
-		//spinlock_release(&stealmem_lock);
-		//return ENOMEM;
 	}
 
 #else
@@ -149,6 +157,27 @@ getppages(unsigned long npages)
 	return addr;
 }
 
+/*
+ * Get physical pages, asking the registered shrinkers to give memory
+ * back before failing. Keep retrying as long as they make progress;
+ * freed pages may not be contiguous, so one pass isn't always enough.
+ */
+static
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr;
+
+	addr = coremap_getppages(npages);
+	while (addr == 0 && shrinker_reclaim(npages) > 0) {
+		addr = coremap_getppages(npages);
+	}
+	if (addr == 0) {
+		kprintf("out of memory!\n");
+	}
+	return addr;
+}
+
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t 
 alloc_kpages(int npages)
@@ -282,6 +311,16 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
 	}
+	else if (faultaddress >= TSTACKBASE && faultaddress < stackbase) {
+		i = (stackbase - 1 - faultaddress) / DUMBVM_STACKSIZE;
+		spinlock_acquire(&as->as_tstacklock);
+		paddr = as->as_tstackpbase[i];
+		spinlock_release(&as->as_tstacklock);
+		if (paddr == 0) {
+			return EFAULT;
+		}
+		paddr += faultaddress - (TSTACKTOP(i) - DUMBVM_STACKSIZE);
+	}
 	else {
 		return EFAULT;
 	}
@@ -331,6 +370,8 @@ struct addrspace *
 as_create(void)
 {
 	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	int i;
+
 	if (as==NULL) {
 		return NULL;
 	}
@@ -345,27 +386,59 @@ as_create(void)
 #if OPT_A3
 	as->loadelfComplete = 0;
 #endif
+	for (i=0; i<AS_NTHREADSTACKS; i++) {
+		as->as_tstackpbase[i] = 0;
+	}
+	as->as_tstackbusy = 0;
+	spinlock_init(&as->as_tstacklock);
 	return as;
 }
 
 void
 as_destroy(struct addrspace *as)
 {	
+#if OPT_A3
+	int i;
+#endif
+
+	cpu_forget_as(as);
+
 #if OPT_A3
 	//if (as==NULL) {
         //    return;
         //}
 
-	//free_kpages(as->as_pbase1);
-	//free_kpages(as->as_pbase2);
-	//free_kpages(as->as_stackpbase);
-	kfree((void *)PADDR_TO_KVADDR(as->as_pbase1));
-	kfree((void *)PADDR_TO_KVADDR(as->as_pbase2));
-	kfree((void *)PADDR_TO_KVADDR(as->as_stackpbase));
+	/*
+	 * These came from getppages, not kmalloc, so hand them
+	 * straight back to the page allocator.
+	 */
+	free_kpages(PADDR_TO_KVADDR(as->as_pbase1));
+	free_kpages(PADDR_TO_KVADDR(as->as_pbase2));
+	free_kpages(PADDR_TO_KVADDR(as->as_stackpbase));
+	for (i=0; i<AS_NTHREADSTACKS; i++) {
+		if (as->as_tstackpbase[i] != 0) {
+			free_kpages(PADDR_TO_KVADDR(as->as_tstackpbase[i]));
+		}
+	}
 #endif
+	spinlock_cleanup(&as->as_tstacklock);
 	kfree(as);
 }
 
+static
+void
+as_destroy_work(void *data)
+{
+	as_destroy(data);
+}
+
+void
+as_destroy_deferred(struct addrspace *as)
+{
+	work_init(&as->as_work, as_destroy_work, as);
+	workqueue_submit(&as->as_work);
+}
+
 void
 as_activate(void)
 {
@@ -377,15 +450,30 @@ as_activate(void)
         /* Kernel threads don't have an address spaces to activate */
 #endif
 	if (as == NULL) {
+		/* Leave the TLB for whoever runs next; see below. */
 		return;
 	}
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	/*
+	 * dumbvm mappings never change once loaded, so if this cpu's
+	 * TLB was last filled for this address space (and nothing has
+	 * run here since but kernel threads, which don't touch user
+	 * addresses) it is still good.
+	 */
+	if (curcpu->c_lastas == as) {
+		curcpu->c_tlbskips++;
+		splx(spl);
+		return;
+	}
+
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+	curcpu->c_lastas = as;
+	curcpu->c_tlbflushes++;
 
 	splx(spl);
 }
@@ -474,7 +562,11 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
-	(void)as;
+	/*
+	 * Text pages were entered writable while loading; make the
+	 * next as_activate really flush so they come back read-only.
+	 */
+	cpu_forget_as(as);
 	return 0;
 }
 
@@ -487,10 +579,71 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+size_t
+as_stacksize(struct addrspace *as)
+{
+	(void)as;
+	return DUMBVM_STACKSIZE;
+}
+
+int
+as_define_threadstack(struct addrspace *as, int *slot, vaddr_t *stackptr)
+{
+	paddr_t pbase;
+	int i;
+
+	spinlock_acquire(&as->as_tstacklock);
+	for (i=0; i<AS_NTHREADSTACKS; i++) {
+		if ((as->as_tstackbusy & (1U << i)) == 0) {
+			break;
+		}
+	}
+	if (i == AS_NTHREADSTACKS) {
+		spinlock_release(&as->as_tstacklock);
+		return ENPROC;
+	}
+	as->as_tstackbusy |= 1U << i;
+	pbase = as->as_tstackpbase[i];
+	spinlock_release(&as->as_tstacklock);
+
+	/*
+	 * The slot is ours now, so nobody else will fill in its pages;
+	 * getppages can sleep, so do it without the spinlock.
+	 */
+	if (pbase == 0) {
+		pbase = getppages(DUMBVM_STACKPAGES);
+		if (pbase == 0) {
+			as_release_threadstack(as, i);
+			return ENOMEM;
+		}
+		spinlock_acquire(&as->as_tstacklock);
+		as->as_tstackpbase[i] = pbase;
+		spinlock_release(&as->as_tstacklock);
+	}
+	as_zero_region(pbase, DUMBVM_STACKPAGES);
+
+	*slot = i;
+	*stackptr = TSTACKTOP(i);
+	return 0;
+}
+
+void
+as_release_threadstack(struct addrspace *as, int slot)
+{
+	KASSERT(slot >= 0 && slot < AS_NTHREADSTACKS);
+
+	spinlock_acquire(&as->as_tstacklock);
+	KASSERT(as->as_tstackbusy & (1U << slot));
+	as->as_tstackbusy &= ~(1U << slot);
+	spinlock_release(&as->as_tstacklock);
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	paddr_t pbase;
+	int i;
 
 	new = as_create();
 	if (new==NULL) {
@@ -523,6 +676,31 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+
+	/*
+	 * Only the forking thread comes along, so of the thread stacks
+	 * only its own slot (if it has one) starts out busy; the rest
+	 * are copied anyway since they may hold data it points at.
+	 */
+	for (i=0; i<AS_NTHREADSTACKS; i++) {
+		spinlock_acquire(&old->as_tstacklock);
+		pbase = old->as_tstackpbase[i];
+		spinlock_release(&old->as_tstacklock);
+		if (pbase == 0) {
+			continue;
+		}
+		new->as_tstackpbase[i] = getppages(DUMBVM_STACKPAGES);
+		if (new->as_tstackpbase[i] == 0) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		memmove((void *)PADDR_TO_KVADDR(new->as_tstackpbase[i]),
+			(const void *)PADDR_TO_KVADDR(pbase),
+			DUMBVM_STACKPAGES*PAGE_SIZE);
+	}
+	if (curthread->t_ustack >= 0) {
+		new->as_tstackbusy = 1U << curthread->t_ustack;
+	}
 	
 	*ret = new;
 	return 0;
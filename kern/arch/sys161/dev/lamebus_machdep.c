@@ -116,6 +116,24 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+/*
+ * Stop and restart hardclock on the current cpu. There's no way to
+ * turn the on-chip timer off, so stopping it pushes the next
+ * interrupt as far out as it will go (2^32 cycles, a few minutes);
+ * if that ever arrives it just restarts the normal rate.
+ */
+void
+mainbus_hardclock_stop(void)
+{
+	mips_timer_set(0xffffffff);
+}
+
+void
+mainbus_hardclock_start(void)
+{
+	mips_timer_set(CPU_FREQUENCY / HZ);
+}
+
 /*
  * Start all secondary CPUs.
  */
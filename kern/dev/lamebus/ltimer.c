@@ -46,7 +46,7 @@
 #define LT_REG_COUNT  16    /* Time for countdown timer (usec) */
 #define LT_REG_SPKR   20    /* Beep control */
 
-static bool havetimerclock;
+static struct ltimer_softc *timerclock_lt;
 
 /*
  * Setup routine called by autoconf stuff when an ltimer is found.
@@ -84,15 +84,15 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 	 * We do, however, use ltimer for the timer clock, since the
 	 * on-chip timer can't do that.
 	 */
-	if (!havetimerclock) {
-		havetimerclock = true;
+	if (timerclock_lt == NULL) {
+		timerclock_lt = lt;
 		lt->lt_timerclock = 1;
 
-		/* Wire it to go off once every 10 ms */
-		/* KMS: reduced this from 1s to 10ms */
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 1);
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT,
-				   LT_GRANULARITY);
+		/*
+		 * Run it one-shot; the timer wheel sets the countdown
+		 * through ltimer_settimer when it has something due.
+		 */
+		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 0);
 	}
 	
 	return 0;
@@ -125,6 +125,22 @@ ltimer_irq(void *vlt)
 	}
 }
 
+/*
+ * Start the timerclock ltimer counting down USECS. Writing the count
+ * restarts the countdown, replacing whatever was set before.
+ */
+void
+ltimer_settimer(uint32_t usecs)
+{
+	struct ltimer_softc *lt = timerclock_lt;
+
+	if (lt == NULL) {
+		/* Not attached yet; timerclock has nothing to run. */
+		return;
+	}
+	bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT, usecs);
+}
+
 /*
  * The timer device will beep if you write to the beep register. It
  * doesn't matter what value you write. This function is called if
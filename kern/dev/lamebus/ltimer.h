@@ -44,10 +44,13 @@ struct ltimer_softc {
 	
 };
 
-/* Granularity of countdown timer (usec) */
+/* Length of a clocknap() tick (usec) */
 /* Should be less than 1000000 */
 #define LT_GRANULARITY   10000
 
+/* Functions called by the timer wheel */
+void ltimer_settimer(uint32_t usecs);  // one-shot timerclock countdown
+
 /* Functions called by lower-level drivers */
 void ltimer_irq(/*struct ltimer_softc*/ void *lt);  // interrupt handler
 
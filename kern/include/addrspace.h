@@ -36,10 +36,15 @@
 
 
 #include <vm.h>
+#include <spinlock.h>
+#include <workqueue.h>
 #include "opt-A3.h"
 
 struct vnode;
 
+/* Extra user stacks available to threads made by __threadfork. */
+#define AS_NTHREADSTACKS 16
+
 
 /* 
  * Address space - data structure associated with the virtual memory
@@ -60,6 +65,10 @@ struct addrspace {
   #if OPT_A3
   int loadelfComplete;
   #endif
+  paddr_t as_tstackpbase[AS_NTHREADSTACKS]; /* 0 until first used */
+  uint32_t as_tstackbusy;	/* bitmask of slots in use */
+  struct spinlock as_tstacklock; /* protects the two above */
+  struct work as_work;		/* for as_destroy_deferred */
 };
 
 /*
@@ -84,6 +93,11 @@ struct addrspace {
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
+ *    as_destroy_deferred - as_destroy, but done later by a workqueue
+ *                thread, so the caller (typically on its way back
+ *                to user mode or out of _exit) needn't wait for it.
+ *                The address space must not be current anywhere.
+ *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
@@ -96,6 +110,18 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_stacksize - the size in bytes of the main user stack of AS.
+ *
+ *    as_define_threadstack - claim one of the extra stack slots for
+ *                a new thread in this address space. Hands back the
+ *                slot number and the thread's initial stack pointer.
+ *                Fails with ENPROC if every slot is taken.
+ *
+ *    as_release_threadstack - give back a slot from
+ *                as_define_threadstack. Its pages stay mapped until
+ *                the address space is destroyed, so TLB entries left
+ *                behind by the old owner remain harmless.
  */
 
 struct addrspace *as_create(void);
@@ -103,6 +129,7 @@ int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
 void              as_destroy(struct addrspace *);
+void              as_destroy_deferred(struct addrspace *);
 
 int               as_define_region(struct addrspace *as, 
                                    vaddr_t vaddr, size_t sz,
@@ -112,6 +139,10 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+size_t            as_stacksize(struct addrspace *as);
+int               as_define_threadstack(struct addrspace *as, int *slot,
+                                        vaddr_t *initstackptr);
+void              as_release_threadstack(struct addrspace *as, int slot);
 
 
 /*
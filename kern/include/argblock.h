@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _ARGBLOCK_H_
+#define _ARGBLOCK_H_
+
+/*
+ * Program arguments on their way to a new user stack, for execv and
+ * runprogram.
+ *
+ * The argument strings are packed back to back, each with its NUL,
+ * into one ARG_MAX-byte buffer, and argblock_copyout lays the argv
+ * pointer array out after them in the same buffer and copies the lot
+ * onto the user stack with a single copyout. So however many
+ * arguments there are, they cost one buffer, no per-string
+ * allocations, and time in proportion to their total size.
+ *
+ * Strings plus pointer array together may take up at most ARG_MAX
+ * bytes; beyond that adding an argument fails with E2BIG. They must
+ * also leave the program most of its stack, which may be smaller
+ * than ARG_MAX; argblock_check tests that.
+ *
+ *    argblock_init     - get a buffer (ENOMEM if there's no memory).
+ *    argblock_copyin   - add the strings of the NULL-terminated user
+ *                        argv array UARGV.
+ *    argblock_add      - add the kernel string ARG.
+ *    argblock_check    - E2BIG if the arguments would take more than
+ *                        half of a user stack of STACKSIZE bytes.
+ *    argblock_copyout  - put the arguments and argv below *STACKPTR
+ *                        in the current address space; update
+ *                        *STACKPTR and return the user argv in
+ *                        *UARGV.
+ *    argblock_cleanup  - give the buffer back.
+ *
+ * Buffers are kept for reuse after argblock_cleanup; a shrinker gives
+ * them back to the VM system under memory pressure.
+ */
+
+struct argblock {
+	char *ab_buf;		/* ARG_MAX bytes */
+	size_t ab_len;		/* bytes of strings so far */
+	unsigned ab_argc;	/* number of strings */
+};
+
+int argblock_init(struct argblock *ab);
+int argblock_copyin(struct argblock *ab, userptr_t uargv);
+int argblock_add(struct argblock *ab, const char *arg);
+int argblock_check(struct argblock *ab, size_t stacksize);
+int argblock_copyout(struct argblock *ab, vaddr_t *stackptr,
+		     userptr_t *uargv);
+void argblock_cleanup(struct argblock *ab);
+
+/* Call once during system startup. */
+void argblock_bootstrap(void);
+
+#endif /* _ARGBLOCK_H_ */
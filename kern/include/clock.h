@@ -38,10 +38,11 @@
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU whenever the one-shot timer
+ * programmed by the timer wheel goes off, to run expired timers.
  *
  * gettime() may be used to fetch the current time of day.
+ * gettime_nsecs() returns the same thing as a count of nanoseconds.
  * getinterval() computes the time from time1 to time2.
  *
  * XXX we have struct timespec now, let's use it.
@@ -62,23 +63,44 @@ void hardclock(void);
 void timerclock(void);
 
 void gettime(time_t *seconds, uint32_t *nanoseconds);
+uint64_t gettime_nsecs(void);
 
 void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
                  time_t *rsecs, uint32_t *rnsecs);
 
+/*
+ * One-shot timers. timer_add arranges for FUNC(DATA) to be called,
+ * once, from the timer interrupt no earlier than WHEN (nanoseconds on
+ * the gettime_nsecs clock). The timer code owns TM until FUNC has
+ * been called; there is no way to cancel a timer.
+ */
+struct timer {
+	struct timer *tm_next;		/* link in wheel slot */
+	uint64_t tm_tick;		/* expiry, in timer wheel ticks */
+	void (*tm_func)(void *);
+	void *tm_data;
+};
+
+void timer_add(struct timer *tm, uint64_t when,
+	       void (*func)(void *), void *data);
+
+/*
+ * thread_sleep_until() suspends execution until the gettime_nsecs
+ * clock reaches DEADLINE. It returns at once if that's already past.
+ */
+void thread_sleep_until(uint64_t deadline);
+
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
- *
- *  this will be more efficient than clocknap() for longer sleeps
  */
 void clocksleep(int seconds);
 
 /*
  * clocknap() suspends execution for the requested number of timer ticks
  *
- * the timer ticks every LT_GRANULARITY usec (see kern/dev/ltimer.h)
+ * a tick is LT_GRANULARITY usec (see kern/dev/ltimer.h)
  *
  */
 void clocknap(int ticks);
@@ -33,9 +33,16 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <thread.h>		/* for struct schedstats */
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Number of scheduler priority levels. Each cpu has one run queue per
+ * level; level 0 is the highest priority. See schedule() in thread.c.
+ */
+#define SCHED_NLEVELS 4
+
 /*
  * Per-cpu structure
  *
@@ -58,15 +65,34 @@ struct cpu {
 	 * Accessed only by this cpu.
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
+	struct wchan *c_migratechan;	/* Its migrator sleeps here; see
+					   thread_migrator */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_lastreset;		/* c_hardclocks at last level reset */
+	struct addrspace *c_lastas;	/* Address space in the TLB, or NULL;
+					   cleared by others via cpu_forget_as */
+	unsigned c_tlbflushes;		/* as_activate calls that flushed */
+	unsigned c_tlbskips;		/* ...and that found c_lastas current */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues by level */
+	unsigned c_runcount;		/* Threads on all run queues */
+	uint32_t c_pass;		/* Pass of the last thread picked */
+	bool c_evict;			/* Queued threads may not run here */
+	struct schedstats c_stats;	/* Accounting for threads run here;
+					   ss_nmigrate is updated atomically */
+
+	/*
+	 * Accessed by other cpus.
+	 * Protected by the thread pool lock.
+	 */
+	struct threadlist c_threadpool;	/* Exited threads kept for reuse */
+	struct spinlock c_threadpool_lock;
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -106,6 +132,14 @@ struct cpu {
  */
 struct cpu *cpu_create(unsigned hardware_number);
 void cpu_machdep_init(struct cpu *);
+
+/*
+ * The VM system calls cpu_forget_as when destroying an address space,
+ * so that no cpu takes a new one allocated at the same address for
+ * the one still in its TLB.
+ */
+struct addrspace;
+void cpu_forget_as(struct addrspace *as);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
@@ -122,10 +122,27 @@ uint32_t random(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ *
+ * With the kheapstats option, every allocation is charged to a tag
+ * so kheap_printstats can show which subsystem is using the heap.
+ * The tag defaults to the source file making the call; a file can
+ * #define KHEAP_TAG to a string of its choice before including this
+ * header to group its allocations differently.
  */
+#include "opt-kheapstats.h"
+
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_bootstrap(void);
+
+#if OPT_KHEAPSTATS
+#ifndef KHEAP_TAG
+#define KHEAP_TAG __FILE__
+#endif
+void *kmalloc_tagged(size_t size, const char *tag);
+#define kmalloc(size) kmalloc_tagged((size), KHEAP_TAG)
+#endif
 
 /*
  * C string functions. 
@@ -142,6 +159,11 @@ char *strchr(const char *searched, int searchfor);
 char *strrchr(const char *searched, int searchfor);
 char *strtok_r(char *buf, const char *seps, char **context);
 
+#if OPT_KHEAPSTATS
+char *kstrdup_tagged(const char *str, const char *tag);
+#define kstrdup(str) kstrdup_tagged((str), KHEAP_TAG)
+#endif
+
 void *memcpy(void *dest, const void *src, size_t len);
 void *memmove(void *dest, const void *src, size_t len);
 void bzero(void *ptr, size_t len);
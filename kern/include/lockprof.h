@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiler (lockprof option).
+ *
+ * Every sleep lock and CV, and every spinlock that asks for it with
+ * spinlock_profile, is charged to a lock class. Locks with the same
+ * name share a class, so e.g. all the per-process exit locks show up
+ * as one line. Per class we count acquisitions and contended
+ * acquisitions and accumulate total and maximum wait and hold times,
+ * measured with gettime(). For a CV, an "acquisition" is a cv_wait
+ * and the wait time is the time spent asleep; CVs have no hold time.
+ *
+ * Nothing is timed until lockprof_bootstrap runs, which must be after
+ * the clock device has attached. The "lp" menu command prints the
+ * classes sorted by total wait time.
+ */
+
+#define LOCKPROF_LOCK	0
+#define LOCKPROF_CV	1
+#define LOCKPROF_SPIN	2
+
+struct lockclass;
+
+/* Find or create the class for NAME. Never fails; see lockprof.c. */
+struct lockclass *lockprof_class(const char *name, unsigned kind);
+
+/* Current time in nanoseconds, or 0 before lockprof_bootstrap. */
+uint64_t lockprof_now(void);
+
+/*
+ * Record an acquisition of a lock in class LC. If the caller had to
+ * wait, CONTENDED is true and WAITSTART is what lockprof_now returned
+ * when it started waiting. Returns the acquisition time, to be passed
+ * to lockprof_released.
+ */
+uint64_t lockprof_acquired(struct lockclass *lc, bool contended,
+			   uint64_t waitstart);
+void lockprof_released(struct lockclass *lc, uint64_t acqtime);
+
+void lockprof_bootstrap(void);
+void lockprof_printstats(void);
+void lockprof_reset(void);
+
+#endif /* _LOCKPROF_H_ */
@@ -52,6 +52,13 @@ void mainbus_interrupt(struct trapframe *);
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
 
+/*
+ * Stop the current cpu's hardclock while it idles, and restart it
+ * once it has work again. Other interrupts still wake it.
+ */
+void mainbus_hardclock_stop(void);
+void mainbus_hardclock_start(void);
+
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
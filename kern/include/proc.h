@@ -45,10 +45,20 @@ struct vnode;
 #ifdef UW
 struct semaphore;
 #endif // UW
+struct rwlock;
 
 #if OPT_A2
-volatile unsigned int pidCount;
-extern struct array *processArray;
+/*
+ * The process table, indexed by slot (see proc_lookup). Slot 0 is
+ * kproc's. processTableLock is held for reading to look processes up
+ * or walk the table, and for writing to add or remove them.
+ */
+#define PROC_NSLOTS	256
+extern struct proc *processTable[PROC_NSLOTS];
+extern struct rwlock *processTableLock;
+
+/* Protects every process's family links; see struct proc. */
+extern struct lock *procFamilyLock;
 #endif
 
 /*
@@ -74,19 +84,63 @@ struct proc {
   struct vnode *console;            /* a vnode for the console device */
 #endif
 
+	/* Scheduler share; see "Stride scheduling" below */
+	unsigned p_tickets;		/* proportional-share weight */
+	uint32_t p_pass;		/* virtual time used so far */
+
+	/* Scheduler accounting, for getrusage (protected by p_lock) */
+	struct schedstats p_stats;	/* threads that have left */
+	struct schedstats p_cstats;	/* children that have exited */
+
 	/* add more material here as needed */
 #if OPT_A2
 	int pid;		/* PID of this process */
 	int parent;		/* Parent's pid of this process */
 
-	int exitStatus; /* Child proecess, add exitStatus for parent to retrieve */
-
-	struct cv *waitExit;  	    /* Let parent process sleep on Child's cv*/
-	struct lock *waitExitLock;  /* Lock for cv waitExit*/
-	struct lock *exitLock;		/* Prevent child process exit before parent process */
+	int exitStatus; /* -1 while running; then kept for the parent to reap */
+
+	struct cv *childExit;	/* waitpid sleeps here for any of our children */
+
+	/*
+	 * Family, protected by procFamilyLock. A child that exits while
+	 * its parent lives stays on the parent's list as a zombie until
+	 * waitpid or the parent's own exit destroys it; one whose parent
+	 * has gone (parentProc NULL) destroys itself.
+	 */
+	struct proc *parentProc;	/* NULL for orphans */
+	struct proc *children;		/* live and zombie children */
+	struct proc *nextSibling;
+	struct proc *prevSibling;
+
+	/*
+	 * Set by the first _exit of a multithreaded process, or by a
+	 * thread in execv (protected by p_lock). The other threads
+	 * leave on their next way back to user mode (see
+	 * proc_exitcheck); after _exit the last one out reports
+	 * exitCode, and execv waits until it is the only one left.
+	 */
+	bool exiting;
+	int exitCode;
+	struct thread *execThread;
+
+	/* vfork child: whose address space we borrow, until exec or exit */
+	struct proc *vforkParent;
+	bool *vforkDone;		/* set for the parent on release */
 #endif
 };
 
+/*
+ * Stride scheduling. Every hardclock a process's threads run advances
+ * its p_pass by PROC_STRIDE1/p_tickets, and within a run queue level
+ * the scheduler runs the thread whose process has the lowest pass. So
+ * CPU time is divided between processes in proportion to their
+ * tickets, however many threads or children each of them has. Tickets
+ * are set with settickets(); children inherit their parent's.
+ */
+#define PROC_DEFTICKETS	100
+#define PROC_MAXTICKETS	1000
+#define PROC_STRIDE1	(1U << 16)
+
 /* This is the process structure for the kernel and for kernel-only threads. */
 extern struct proc *kproc;
 
@@ -107,8 +161,8 @@ void proc_destroy(struct proc *proc);
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
-/* Detach a thread from its process. */
-void proc_remthread(struct thread *t);
+/* Detach a thread from its process; returns the number of threads left. */
+unsigned proc_remthread(struct thread *t);
 
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
@@ -116,5 +170,35 @@ struct addrspace *curproc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *curproc_setas(struct addrspace *);
 
+/* Scheduler accounting for all of PROC's threads, past and present. */
+void proc_getstats(struct proc *proc, struct schedstats *ret);
+
+#if OPT_A2
+/* Find the process with pid PID, or NULL. Hold processTableLock. */
+struct proc *proc_lookup(pid_t pid);
+
+/* True if proc_create_runprogram would fail for lack of a pid. */
+bool proc_tablefull(void);
+
+/*
+ * Family links. proc_addchild takes procFamilyLock itself; the others
+ * must be called with it held.
+ */
+void proc_addchild(struct proc *parent, struct proc *child);
+void proc_remchild(struct proc *child);
+struct proc *proc_findchild(struct proc *parent, pid_t pid);
+struct proc *proc_findzombie(struct proc *parent);
+
+/* Print scheduler accounting for each process. */
+void proc_printstats(void);
+
+/*
+ * Called on the way back to user mode: if another thread of the
+ * current process has called _exit, leave instead (does not return).
+ * Defined in proc_syscalls.c.
+ */
+void proc_exitcheck(void);
+#endif
+
 
 #endif /* _PROC_H_ */
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SHRINKER_H_
+#define _SHRINKER_H_
+
+/*
+ * Memory-pressure reclaim callbacks.
+ *
+ * A kernel cache that holds on to pages it could give back (empty
+ * kmalloc pages, zombie thread stacks, ...) registers a shrinker.
+ * When the page allocator cannot satisfy a request it calls the
+ * registered shrinkers and retries before failing.
+ *
+ * A shrinker is called with the number of pages the allocator is
+ * short and should free up to that many (it may free more or fewer)
+ * and return how many it actually released. It must not call
+ * alloc_kpages itself.
+ *
+ * Shrinkers registered with SHRINK_MAYSLEEP may block; they are only
+ * run when the allocating thread is itself allowed to sleep (not in
+ * an interrupt handler and not holding a spinlock). Shrinkers without
+ * the flag may only take spinlocks and are run in any context.
+ *
+ * Registration is permanent; the table is fixed-size so that it can
+ * be used before (and without) kmalloc working.
+ */
+
+#define SHRINK_MAYSLEEP   1
+
+typedef unsigned (*shrinker_func)(void *data, unsigned npages);
+
+int shrinker_register(const char *name, shrinker_func func, void *data,
+		      unsigned flags);
+
+/* Run the shrinkers; returns the number of pages released. */
+unsigned shrinker_reclaim(unsigned npages);
+
+/* Print per-shrinker call/reclaim counts (part of "kh"). */
+void shrinker_printstats(void);
+
+#endif /* _SHRINKER_H_ */
@@ -36,6 +36,7 @@
  */
 
 #include <cdefs.h>
+#include "opt-lockprof.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -50,6 +51,14 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * A spinlock is either test-and-set (the default) or ticket. A
+ * test-and-set lock is cheapest when uncontended, but waiters all
+ * hammer the one lock word and whichever cpu wins the race gets the
+ * lock. A ticket lock takes a number from lk_next and waits for
+ * lk_lock (the number now being served) to reach it, so waiters only
+ * read while spinning and are served in arrival order. Use ticket
+ * locks for the few spinlocks that are actually fought over.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
@@ -57,17 +66,32 @@
 struct spinlock {
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+	volatile spinlock_data_t lk_next; /* Next ticket to hand out. */
+	bool lk_ticket;			/* Ticket lock if true. */
+#if OPT_LOCKPROF
+	struct lockclass *lk_prof;	/* Profiling class, if any. */
+	uint64_t lk_acqtime;		/* When the holder got it. */
+#endif
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKPROF
+#define SPINLOCK_PROF_INITIALIZER	, NULL, 0
+#else
+#define SPINLOCK_PROF_INITIALIZER
+#endif
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, NULL, 0, false SPINLOCK_PROF_INITIALIZER }
+#define SPINLOCK_TICKET_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, NULL, 0, true SPINLOCK_PROF_INITIALIZER }
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
+ * init_ticket	Same, but make it a ticket lock.
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
@@ -77,6 +101,7 @@ struct spinlock {
  */
 
 void spinlock_init(struct spinlock *lk);
+void spinlock_init_ticket(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
@@ -84,5 +109,13 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+#if OPT_LOCKPROF
+/*
+ * Unlike sleep locks, spinlocks are only profiled on request, since
+ * there are a great many of them and timing each one is expensive.
+ */
+void spinlock_profile(struct spinlock *lk, const char *name);
+#endif
+
 
 #endif /* _SPINLOCK_H_ */
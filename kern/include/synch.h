@@ -36,18 +36,25 @@
 
 
 #include <spinlock.h>
+#include "opt-lockprof.h"
 
 /*
  * Dijkstra-style semaphore.
  *
  * The name field is for easier debugging. A copy of the name is made
  * internally.
+ *
+ * sem_count is updated with atomic operations, so P on a positive
+ * count and V with nobody waiting never touch sem_lock or the wait
+ * channel. sem_waiters counts threads in the slow path of P; it is
+ * changed only under sem_lock.
  */
 struct semaphore {
         char *sem_name;
 	struct wchan *sem_wchan;
 	struct spinlock sem_lock;
-        volatile int sem_count;
+        volatile unsigned sem_count;
+        volatile unsigned sem_waiters;
 };
 
 struct semaphore *sem_create(const char *name, int initial_count);
@@ -80,6 +87,17 @@ struct lock {
         struct spinlock lock_spin;
         volatile struct thread *lock_owner;
         volatile bool lock_held;
+        /* Contention counters, protected by lock_spin. */
+        unsigned lock_nacquire;         /* total acquisitions */
+        unsigned lock_nspin;            /* acquired after spinning */
+        unsigned lock_nsleep;           /* had to sleep at least once */
+        /* Priority inheritance (see thread_inherit), under lock_spin. */
+        unsigned lock_prio;             /* best level lent by sleepers */
+        struct lock *lock_next;         /* next in owner's t_locks */
+#if OPT_LOCKPROF
+        struct lockclass *lock_prof;    /* profiling class */
+        uint64_t lock_acqtime;          /* when the owner got it */
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -100,6 +118,17 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+/*
+ * Locks are adaptive: a thread that finds the lock held spins, for at
+ * most LOCK_SPIN_MAX iterations, as long as the owner is running on
+ * another cpu, and only sleeps on the wait channel when the owner is
+ * not running. lock_printstats prints system-wide counts of how
+ * contended acquisitions were resolved.
+ */
+#define LOCK_SPIN_MAX	10000
+
+void lock_printstats(void);
+
 
 /*
  * Condition variable.
@@ -120,6 +149,9 @@ struct cv {
         // add what you need here
         // (don't forget to mark things volatile as needed)
         struct wchan *cv_wchan;
+#if OPT_LOCKPROF
+        struct lockclass *cv_prof;      /* profiling class */
+#endif
 };
 
 struct cv *cv_create(const char *name);
@@ -143,4 +175,53 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or a single
+ * writer. Writers are preferred: once a writer is waiting, new
+ * readers queue behind it. So that a steady stream of writers can't
+ * starve readers forever, after RWLOCK_MAXWRITERS writers in a row
+ * have gone ahead of waiting readers, all of the readers waiting at
+ * that point are let in before the next writer.
+ *
+ * Like locks, rwlocks may sleep and may not be used in interrupt
+ * handlers. They are not recursive.
+ */
+#define RWLOCK_MAXWRITERS	4
+
+struct rwlock {
+        char *rw_name;
+        struct wchan *rw_rwchan;        /* readers wait here */
+        struct wchan *rw_wwchan;        /* writers wait here */
+        struct spinlock rw_spin;
+        volatile struct thread *rw_writer;      /* current writer */
+        volatile unsigned rw_readers;   /* current readers */
+        unsigned rw_rwait;              /* readers waiting */
+        unsigned rw_wwait;              /* writers waiting */
+        unsigned rw_wstreak;            /* writers served while readers wait */
+        unsigned rw_rgrant;             /* readers admitted past writers */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Give up the write hold.
+ *    rwlock_do_i_write    - Return true if the current thread holds
+ *                           the lock for writing. (There is no
+ *                           equivalent for readers, which aren't
+ *                           tracked individually.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
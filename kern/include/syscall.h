@@ -46,6 +46,9 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(void *tf, unsigned long data2);
 
+/* Helper for __threadfork(). */
+void enter_new_thread(void *tf, unsigned long data2);
+
 /* Enter user mode. Does not return. */
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
@@ -65,8 +68,14 @@ int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 
 int sys_fork(pid_t *retval, struct trapframe *tf);
+int sys_vfork(pid_t *retval, struct trapframe *tf);
 
 int sys_execv(const_userptr_t progname, userptr_t args);
+int sys_settickets(pid_t pid, int tickets, int32_t *retval);
+int sys_setaffinity(pid_t pid, uint32_t mask);
+int sys_getrusage(int who, userptr_t usage);
+int sys___threadfork(userptr_t entry, userptr_t arg, struct trapframe *tf);
+void sys___threadexit(void);
 
 #endif // UW
 
@@ -60,6 +60,11 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwlocktest(int, char **);
+int spinlockbench(int, char **);
+int atomicbench(int, char **);
+int workqueuetest(int, char **);
+int affinitytest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -64,6 +65,24 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/*
+ * Scheduler accounting, kept per thread, per cpu, and per process
+ * (for threads and children that have gone). Times are nanoseconds
+ * on the gettime clock. A switch away from a thread that blocks or
+ * exits is voluntary; one where it stays runnable (preemption or
+ * yield) is involuntary.
+ */
+struct schedstats {
+	uint64_t ss_runtime;		/* time on a cpu */
+	uint64_t ss_waittime;		/* time runnable, waiting on a queue */
+	unsigned ss_nvcsw;		/* voluntary switches */
+	unsigned ss_nivcsw;		/* involuntary switches */
+	unsigned ss_nmigrate;		/* moves to another cpu */
+};
+
+/* Names up to this long are kept in the thread itself, not kmalloc'd */
+#define THREAD_NAMELEN 16
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -77,12 +96,14 @@ struct thread {
 	/*
 	 * Thread subsystem internal fields.
 	 */
+	char t_namebuf[THREAD_NAMELEN];	/* t_name, if it fits */
 	struct thread_machdep t_machdep; /* Any machine-dependent goo */
 	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	int t_ustack;			/* User stack slot, -1 for main stack */
 
 	/*
 	 * Interrupt state fields.
@@ -101,6 +122,23 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * Scheduler fields. t_priority is the run queue level the
+	 * thread is queued on (0 is highest); t_quantum is the number
+	 * of hardclocks it may still run before being demoted.
+	 */
+	unsigned t_priority;		/* Current scheduler level */
+	unsigned t_quantum;		/* Hardclocks left at this level */
+	unsigned t_lastrun;		/* Its cpu's c_hardclocks when it
+					   last stopped running */
+	uint32_t t_affinity;		/* CPUs it may run on (bit per cpu) */
+	unsigned t_boost;		/* Level lent by threads waiting on
+					   its locks, or SCHED_NLEVELS */
+	struct lock *t_locks;		/* Sleep locks it holds */
+	struct schedstats t_stats;	/* Accounting; see thread_switch */
+	uint64_t t_stamp;		/* When it last started running or
+					   waiting to run, or 0 */
+
 	/*
 	 * Public fields
 	 */
@@ -108,6 +146,11 @@ struct thread {
 	/* add more here as needed */
 };
 
+/*
+ * CPU affinity masks: bit N set means the thread may run on cpu N.
+ */
+#define THREAD_AFFINITY_ANY	0xffffffffU
+
 /*
  * Array of threads.
  */
@@ -124,6 +167,9 @@ void thread_bootstrap(void);
 /* Call late in system startup to get secondary CPUs running. */
 void thread_start_cpus(void);
 
+/* Number of cpus in the system. */
+unsigned thread_numcpus(void);
+
 /* Call during panic to stop other threads in their tracks */
 void thread_panic(void);
 
@@ -157,14 +203,59 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for one hardclock, and switch away if its
+ * quantum is used up or a higher-priority thread is waiting. Called
+ * from the timer interrupt.
+ */
+void thread_timeslice(void);
+
+/*
+ * Restrict thread T to the cpus in MASK. Other threads move when they
+ * are next queued to run; if T is the current thread and may no longer
+ * run on this cpu, it has moved to one it may run on by the time this
+ * returns (once secondary cpus are started). New threads inherit the
+ * affinity of the thread that forks them. Returns EINVAL if MASK
+ * names no existing cpu.
+ */
+int thread_setaffinity(struct thread *t, uint32_t mask);
+
+/*
+ * Priority inheritance, for sleep locks (see synch.c). A thread runs
+ * at the better of its own level and the level lent to it by threads
+ * waiting for locks it holds.
+ *
+ *    thread_level      - the level T currently runs at.
+ *    thread_inherit    - lend LEVEL to T, requeueing it if it is
+ *                        waiting to run at a worse level.
+ *    thread_disinherit - recompute the current thread's lent level
+ *                        from the locks it still holds.
+ */
+unsigned thread_level(struct thread *t);
+void thread_inherit(struct thread *t, unsigned level);
+void thread_disinherit(void);
+
+/*
+ * Scheduler accounting (see struct schedstats).
+ *
+ *    schedstats_bootstrap - start timing; call once the clock is attached.
+ *    schedstats_add       - add FROM into TO.
+ *    thread_getstats      - T's totals, including its current run.
+ *    thread_printstats    - print per-cpu totals.
+ */
+void schedstats_bootstrap(void);
+void schedstats_add(struct schedstats *to, const struct schedstats *from);
+void thread_getstats(struct thread *t, struct schedstats *ret);
+void thread_printstats(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Potentially pull ready threads over from busier CPUs. Called from
+ * the timer interrupt.
  */
 void thread_consider_migration(void);
 
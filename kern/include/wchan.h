@@ -81,5 +81,28 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Wake up the particular thread T, which must be sleeping on WC.
+ * The queue should not already be locked.
+ */
+struct thread;
+void wchan_wakethread(struct wchan *wc, struct thread *t);
+
+/*
+ * Move one thread, or all threads, sleeping on FROM over to TO
+ * without waking them; they stay asleep until woken from TO. Returns
+ * the number moved. Neither queue should already be locked. Callers
+ * that use this on more than one pair of channels must always move
+ * threads in the same direction between them, or they can deadlock.
+ */
+unsigned wchan_transfer(struct wchan *from, struct wchan *to, bool all);
+
+/*
+ * Return the best (numerically lowest) scheduling level of the
+ * threads sleeping on WC, or SCHED_NLEVELS if there are none. The
+ * queue should not already be locked.
+ */
+unsigned wchan_toplevel(struct wchan *wc);
+
 
 #endif /* _WCHAN_H_ */
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Workqueues: deferred work run by kernel worker threads.
+ *
+ * Each cpu has a worker thread and a FIFO of work items. A work
+ * item is a function and an argument; the caller owns the struct
+ * work (usually embedded in whatever the work is about) and must
+ * keep it around until the function has started running.
+ *
+ *    work_init        - set up W to call FUNC(DATA).
+ *    workqueue_submit - queue W on the current cpu's worker. Returns
+ *                       false if W was already queued. May be called
+ *                       from interrupt handlers and under spinlocks.
+ *    workqueue_submit_delayed
+ *                     - likewise, but queue it DELAY nanoseconds from
+ *                       now (using a clock timer).
+ *    workqueue_flush  - wait until everything submitted before the
+ *                       call (not counting delayed items whose delay
+ *                       hasn't run out) has finished running. Must
+ *                       not be called from a work function.
+ *
+ * Work functions run in thread context and may sleep, but whatever
+ * they sleep on holds up the rest of that cpu's queue. An item may
+ * resubmit itself. Before workqueue_bootstrap, submitted work is just
+ * run on the spot.
+ */
+
+#include <clock.h>
+
+struct work {
+	struct work *w_next;		/* queue link */
+	void (*w_func)(void *);
+	void *w_data;
+	struct timer w_timer;		/* for delayed submits */
+	unsigned w_cpu;			/* queue chosen for a delayed submit */
+	volatile unsigned w_pending;	/* queued or waiting on w_timer */
+};
+
+void work_init(struct work *w, void (*func)(void *), void *data);
+bool workqueue_submit(struct work *w);
+bool workqueue_submit_delayed(struct work *w, uint64_t delay);
+void workqueue_flush(void);
+
+/* Start the workers; call once all cpus are up. */
+void workqueue_bootstrap(void);
+
+/* Print per-cpu queue statistics. */
+void workqueue_printstats(void);
+
+#endif /* _WORKQUEUE_H_ */
@@ -33,7 +33,27 @@
 
 /*
  * Like strdup, but calls kmalloc.
+ *
+ * With kheapstats the copy is charged to the caller's tag rather
+ * than to this file.
  */
+#if OPT_KHEAPSTATS
+#undef kstrdup
+
+char *
+kstrdup_tagged(const char *s, const char *tag)
+{
+	char *z;
+
+	z = kmalloc_tagged(strlen(s)+1, tag);
+	if (z == NULL) {
+		return NULL;
+	}
+	strcpy(z, s);
+	return z;
+}
+#endif
+
 char *
 kstrdup(const char *s)
 {
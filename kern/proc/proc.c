@@ -43,6 +43,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -50,6 +51,7 @@
 #include <vfs.h>
 #include <synch.h>
 #include <kern/fcntl.h>  
+#include <kern/limits.h>
 #include "opt-A2.h"
 
 /*
@@ -72,9 +74,170 @@ struct semaphore *no_proc_sem;
 #endif  // UW
 
 #if OPT_A2  
-struct lock *pidCountLock;
-struct array *processArray;
-struct lock *processArrayLock; 
+/*
+ * The process table. A pid is a slot number plus PROC_NSLOTS times
+ * the slot's generation, which goes up each time the slot is freed,
+ * so a stale pid doesn't find whatever took the slot over. Free slots
+ * are kept in FIFO order on a list threaded through pidNext, so that
+ * the one freed longest ago is reused first and allocating and
+ * freeing are O(1). All of it is protected by processTableLock.
+ */
+#define PID_NGENS	((__PID_MAX + 1) / PROC_NSLOTS)
+#define PID_NONE	PROC_NSLOTS	/* end of the free list */
+
+struct proc *processTable[PROC_NSLOTS];
+struct rwlock *processTableLock; 
+struct lock *procFamilyLock;
+static unsigned pidGen[PROC_NSLOTS];
+static unsigned pidNext[PROC_NSLOTS];
+static unsigned pidFreeHead, pidFreeTail;
+
+/*
+ * Put PROC in a free slot and give it the slot's pid. Returns ENPROC
+ * if the table is full.
+ */
+static
+int
+pid_alloc(struct proc *proc)
+{
+	unsigned slot;
+
+	KASSERT(rwlock_do_i_write(processTableLock));
+
+	slot = pidFreeHead;
+	if (slot == PID_NONE) {
+		return ENPROC;
+	}
+	pidFreeHead = pidNext[slot];
+	if (pidFreeHead == PID_NONE) {
+		pidFreeTail = PID_NONE;
+	}
+	KASSERT(processTable[slot] == NULL);
+	processTable[slot] = proc;
+	proc->pid = pidGen[slot] * PROC_NSLOTS + slot;
+	return 0;
+}
+
+/*
+ * Release PROC's slot, retiring its pid.
+ */
+static
+void
+pid_free(struct proc *proc)
+{
+	unsigned slot;
+
+	KASSERT(rwlock_do_i_write(processTableLock));
+
+	slot = proc->pid % PROC_NSLOTS;
+	KASSERT(processTable[slot] == proc);
+	processTable[slot] = NULL;
+	pidGen[slot] = (pidGen[slot] + 1) % PID_NGENS;
+	pidNext[slot] = PID_NONE;
+	if (pidFreeTail == PID_NONE) {
+		pidFreeHead = slot;
+	}
+	else {
+		pidNext[pidFreeTail] = slot;
+	}
+	pidFreeTail = slot;
+}
+
+struct proc *
+proc_lookup(pid_t pid)
+{
+	struct proc *proc;
+
+	if (pid < 0 || pid > __PID_MAX) {
+		return NULL;
+	}
+	proc = processTable[pid % PROC_NSLOTS];
+	if (proc == NULL || proc->pid != pid) {
+		return NULL;
+	}
+	return proc;
+}
+
+bool
+proc_tablefull(void)
+{
+	/* unlocked; fork uses it as a hint, and allocation rechecks */
+	return pidFreeHead == PID_NONE;
+}
+
+void
+proc_addchild(struct proc *parent, struct proc *child)
+{
+	lock_acquire(procFamilyLock);
+	KASSERT(child->parentProc == NULL);
+	child->parentProc = parent;
+	child->parent = parent->pid;
+	child->prevSibling = NULL;
+	child->nextSibling = parent->children;
+	if (parent->children != NULL) {
+		parent->children->prevSibling = child;
+	}
+	parent->children = child;
+	lock_release(procFamilyLock);
+}
+
+void
+proc_remchild(struct proc *child)
+{
+	struct proc *parent = child->parentProc;
+
+	KASSERT(lock_do_i_hold(procFamilyLock));
+	KASSERT(parent != NULL);
+
+	if (child->prevSibling != NULL) {
+		child->prevSibling->nextSibling = child->nextSibling;
+	}
+	else {
+		KASSERT(parent->children == child);
+		parent->children = child->nextSibling;
+	}
+	if (child->nextSibling != NULL) {
+		child->nextSibling->prevSibling = child->prevSibling;
+	}
+	child->nextSibling = child->prevSibling = NULL;
+	child->parentProc = NULL;
+	child->parent = -1;
+}
+
+struct proc *
+proc_findchild(struct proc *parent, pid_t pid)
+{
+	struct proc *child;
+
+	KASSERT(lock_do_i_hold(procFamilyLock));
+
+	for (child = parent->children; child != NULL;
+	     child = child->nextSibling) {
+		if (child->pid == pid) {
+			return child;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Return a child of PARENT that has exited, or NULL if none has.
+ */
+struct proc *
+proc_findzombie(struct proc *parent)
+{
+	struct proc *child;
+
+	KASSERT(lock_do_i_hold(procFamilyLock));
+
+	for (child = parent->children; child != NULL;
+	     child = child->nextSibling) {
+		if (child->exitStatus != -1) {
+			return child;
+		}
+	}
+	return NULL;
+}
 #endif
 
 
@@ -106,6 +269,12 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
+	/* Scheduler fields */
+	proc->p_tickets = PROC_DEFTICKETS;
+	proc->p_pass = 0;
+	bzero(&proc->p_stats, sizeof(proc->p_stats));
+	bzero(&proc->p_cstats, sizeof(proc->p_cstats));
+
 #ifdef UW
 	proc->console = NULL;
 #endif // UW
@@ -114,9 +283,16 @@ proc_create(const char *name)
 	proc->pid = -1;
 	proc->parent = -1;
 	proc->exitStatus = -1;
-	proc->waitExit = cv_create("waitExit");
-	proc->waitExitLock = lock_create("waitExit");
-	proc->exitLock = lock_create("exitLock");
+	proc->exiting = false;
+	proc->exitCode = 0;
+	proc->execThread = NULL;
+	proc->childExit = cv_create("childExit");
+	proc->parentProc = NULL;
+	proc->children = NULL;
+	proc->nextSibling = NULL;
+	proc->prevSibling = NULL;
+	proc->vforkParent = NULL;
+	proc->vforkDone = NULL;
 #endif
 	return proc;
 }
@@ -183,17 +359,18 @@ proc_destroy(struct proc *proc)
 
 	kfree(proc->p_name);
 #if OPT_A2
-	// set the entry to NULL in process table
-	// cannot remove because sys__exit need to loop proc table by PID
-	//lock_acquire(processArrayLock); 
-	if(proc->pid > 0){
-		array_set(processArray, proc->pid, NULL);
+	// free the pid, under the lock so that lookups by pid
+	// (settickets, waitpid) can't see a freed proc
+	if (proc->pid > 0) {
+		rwlock_acquire_write(processTableLock); 
+		pid_free(proc);
+		rwlock_release_write(processTableLock);
 	}
-	//lock_release(processArrayLock);
 
-	cv_destroy(proc->waitExit);
-	lock_destroy(proc->waitExitLock);
-	lock_destroy(proc->exitLock);
+	// our parent has unlinked us, and we have let go of our children
+	KASSERT(proc->parentProc == NULL);
+	KASSERT(proc->children == NULL);
+	cv_destroy(proc->childExit);
 #endif
 	kfree(proc);
 #ifdef UW
@@ -226,18 +403,34 @@ proc_bootstrap(void)
   }
 #if OPT_A2
   // Initialize process table, PID
-  pidCountLock = lock_create("pidCount");
-  pidCount = 0;
-
-  processArray = array_create();
-  array_init(processArray);
-  processArrayLock = lock_create("processArray");
+  // lookups by pid far outnumber forks and exits
+  processTableLock = rwlock_create("processTable");
+  if (processTableLock == NULL) {
+    panic("could not create processTableLock\n");
+  }
+  procFamilyLock = lock_create("procFamily");
+  if (procFamilyLock == NULL) {
+    panic("could not create procFamilyLock\n");
+  }
 
-  unsigned int pid;
-  array_add(processArray, kproc, &(pid));
-  kproc->pid=pid;
-  array_add(processArray, NULL, &(pid));
-	
+  // kproc is pid 0; user pids start at PID_MIN, so slots below that
+  // never go on the free list
+  processTable[0] = kproc;
+  kproc->pid = 0;
+  pidFreeHead = pidFreeTail = PID_NONE;
+  for (unsigned slot = 0; slot < PROC_NSLOTS; slot++) {
+    pidGen[slot] = 0;
+    pidNext[slot] = PID_NONE;
+    if (slot >= __PID_MIN) {
+      if (pidFreeTail == PID_NONE) {
+        pidFreeHead = slot;
+      }
+      else {
+        pidNext[pidFreeTail] = slot;
+      }
+      pidFreeTail = slot;
+    }
+  }
 #endif
 
 #ifdef UW
@@ -265,6 +458,9 @@ proc_create_runprogram(const char *name)
 {
 	struct proc *proc;
 	char *console_path;
+#if OPT_A2
+	int result;
+#endif
 
 	proc = proc_create(name);
 	if (proc == NULL) {
@@ -307,21 +503,6 @@ proc_create_runprogram(const char *name)
 #endif // UW
 
 	  
-#if OPT_A2
-	//lock_acquire(pidCountLock);
-	//  pidCount += 1;
-    //  proc->pid = pidCount;
-    //lock_release(pidCountLock);
-
-    lock_acquire(processArrayLock);
-      unsigned int pid;
-
-      array_add(processArray, proc, &(pid));
-      proc->pid=pid;
-
-    lock_release(processArrayLock);
-#endif
-
 #ifdef UW
 	/* increment the count of processes */
         /* we are assuming that all procs, including those created by fork(),
@@ -331,6 +512,20 @@ proc_create_runprogram(const char *name)
 	V(proc_count_mutex);
 #endif // UW
 
+#if OPT_A2
+	rwlock_acquire_write(processTableLock);
+	result = pid_alloc(proc);
+	rwlock_release_write(processTableLock);
+	if (result) {
+		/*
+		 * pid is still -1, so proc_destroy won't free a slot;
+		 * it will take back the proc_count we just added.
+		 */
+		proc_destroy(proc);
+		return NULL;
+	}
+#endif
+
 	return proc;
 }
 
@@ -357,9 +552,10 @@ proc_addthread(struct proc *proc, struct thread *t)
 
 /*
  * Remove a thread from its process. Either the thread or the process
- * might or might not be current.
+ * might or might not be current. Returns how many threads the process
+ * has left, so the last one out knows it is.
  */
-void
+unsigned
 proc_remthread(struct thread *t)
 {
 	struct proc *proc;
@@ -374,9 +570,10 @@ proc_remthread(struct thread *t)
 	for (i=0; i<num; i++) {
 		if (threadarray_get(&proc->p_threads, i) == t) {
 			threadarray_remove(&proc->p_threads, i);
+			schedstats_add(&proc->p_stats, &t->t_stats);
 			spinlock_release(&proc->p_lock);
 			t->t_proc = NULL;
-			return;
+			return num - 1;
 		}
 	}
 	/* Did not find it. */
@@ -386,8 +583,8 @@ proc_remthread(struct thread *t)
 
 /*
  * Fetch the address space of the current process. Caution: it isn't
- * refcounted. If you implement multithreaded processes, make sure to
- * set up a refcount scheme or some other method to make this safe.
+ * refcounted. That is safe for threads of the process itself, since
+ * only the last of them to leave takes it away (see proc_leave).
  */
 struct addrspace *
 curproc_getas(void)
@@ -424,3 +621,45 @@ curproc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
+
+void
+proc_getstats(struct proc *proc, struct schedstats *ret)
+{
+	struct schedstats ts;
+	unsigned i, num;
+
+	spinlock_acquire(&proc->p_lock);
+	*ret = proc->p_stats;
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		thread_getstats(threadarray_get(&proc->p_threads, i), &ts);
+		schedstats_add(ret, &ts);
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+#if OPT_A2
+void
+proc_printstats(void)
+{
+	struct proc *proc;
+	struct schedstats ss;
+	unsigned i;
+
+	kprintf("%5s %-16s %9s %9s %9s %9s %9s\n", "pid", "name",
+		"run(ms)", "wait(ms)", "vcsw", "ivcsw", "migrated");
+	rwlock_acquire_read(processTableLock);
+	for (i=0; i<PROC_NSLOTS; i++) {
+		proc = processTable[i];
+		if (proc == NULL) {
+			continue;
+		}
+		proc_getstats(proc, &ss);
+		kprintf("%5d %-16s %9llu %9llu %9u %9u %9u\n",
+			proc->pid, proc->p_name,
+			ss.ss_runtime / 1000000, ss.ss_waittime / 1000000,
+			ss.ss_nvcsw, ss.ss_nivcsw, ss.ss_nmigrate);
+	}
+	rwlock_release_read(processTableLock);
+}
+#endif
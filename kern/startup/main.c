@@ -49,7 +49,11 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <workqueue.h>
+#include <argblock.h>
+#include <lockprof.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-lockprof.h"
 
 
 /*
@@ -107,6 +111,7 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	kheap_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
@@ -120,11 +125,19 @@ boot(void)
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
+#if OPT_LOCKPROF
+	/* The clock is attached now, so lock timing can start. */
+	lockprof_bootstrap();
+#endif
+	/* And so can scheduler timing. */
+	schedstats_bootstrap();
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
+	workqueue_bootstrap();
+	argblock_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
@@ -35,16 +35,24 @@
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
+#include <current.h>
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <shrinker.h>
+#include <lockprof.h>
+#include <schedtrace.h>
+#include <workqueue.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockprof.h"
+#include "opt-schedtrace.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -295,6 +303,32 @@ cmd_dth(int nargs, char **args)
 	
 }
 
+/*
+ * Command for restricting the menu thread to some cpus. Programs
+ * started from the menu inherit the restriction.
+ */
+static
+int
+cmd_pin(int nargs, char **args)
+{
+	uint32_t mask;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: pin cpumask\n");
+		return EINVAL;
+	}
+
+	mask = (uint32_t)atoi(args[1]);
+	result = thread_setaffinity(curthread, mask);
+	if (result) {
+		return result;
+	}
+	KASSERT((mask & ((uint32_t)1 << curcpu->c_number)) != 0);
+	kprintf("Menu thread now on cpu%u\n", curcpu->c_number);
+	return 0;
+}
+
 /*
  * Command for shutting down.
  */
@@ -414,10 +448,87 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kprintf("\n");
+	shrinker_printstats();
 	
 	return 0;
 }
 
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lock_printstats();
+	return 0;
+}
+
+#if OPT_LOCKPROF
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockprof_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: lp [reset]\n");
+		return EINVAL;
+	}
+
+	lockprof_printstats();
+	return 0;
+}
+#endif
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+#if OPT_A2
+	kprintf("\n");
+	proc_printstats();
+#endif
+	return 0;
+}
+
+static
+int
+cmd_workqueuestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	workqueue_printstats();
+	return 0;
+}
+
+#if OPT_SCHEDTRACE
+static
+int
+cmd_schedtrace(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		schedtrace_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: st [reset]\n");
+		return EINVAL;
+	}
+
+	schedtrace_dump();
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -459,6 +570,7 @@ static const char *opsmenu[] = {
 	"[sync]    Sync filesystems          ",
 	"[panic]   Intentional panic         ",
 	"[dth]     Enable DB_THREADS messages",
+	"[pin]     Pin menu thread to cpus   ",
 	"[q]       Quit and shut down        ",
 	NULL
 };
@@ -488,6 +600,11 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Rwlock test                   ",
+	"[slb] Spinlock benchmark [secs]     ",
+	"[atb] Atomics/semaphore benchmark   ",
+	"[wqt] Workqueue test                ",
+	"[aft] Affinity test                 ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -528,6 +645,15 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[lk] Kernel lock stats              ",
+#if OPT_LOCKPROF
+	"[lp] Lock profile [reset]           ",
+#endif
+	"[ss] Scheduler stats                ",
+	"[wq] Workqueue stats                ",
+#if OPT_SCHEDTRACE
+	"[st] Scheduler trace [reset]        ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -570,6 +696,7 @@ static struct {
 	{ "sync",	cmd_sync },
 	{ "panic",	cmd_panic },
 	{ "dth",        cmd_dth },
+	{ "pin",	cmd_pin },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
@@ -585,6 +712,15 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "lk",         cmd_lockstats },
+#if OPT_LOCKPROF
+	{ "lp",         cmd_lockprof },
+#endif
+	{ "ss",         cmd_schedstats },
+	{ "wq",         cmd_workqueuestats },
+#if OPT_SCHEDTRACE
+	{ "st",         cmd_schedtrace },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -602,6 +738,11 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwlocktest },
+	{ "slb",	spinlockbench },
+	{ "atb",	atomicbench },
+	{ "wqt",	workqueuetest },
+	{ "aft",	affinitytest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Argument blocks for execv and runprogram. See argblock.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <limits.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <shrinker.h>
+#include <argblock.h>
+
+/*
+ * Cache of free buffers. Exec is usually quick to come round again,
+ * and for 64K at a time it's worth not going back to the page
+ * allocator each time. The first word of a free buffer links it to
+ * the next. Up to ARGBLOCK_NCACHE are kept.
+ */
+#define ARGBLOCK_NCACHE	4
+
+static struct spinlock argblock_lock = SPINLOCK_INITIALIZER;
+static char *argblock_free;
+static unsigned argblock_nfree;
+
+/*
+ * Bytes the arguments would take on the stack with ARGC strings
+ * totalling LEN bytes: the strings, padded so the array is aligned,
+ * then ARGC+1 pointers.
+ */
+static
+size_t
+argblock_size(size_t len, unsigned argc)
+{
+	return ROUNDUP(len, sizeof(userptr_t)) +
+		(argc + 1) * sizeof(userptr_t);
+}
+
+int
+argblock_init(struct argblock *ab)
+{
+	char *buf;
+
+	spinlock_acquire(&argblock_lock);
+	buf = argblock_free;
+	if (buf != NULL) {
+		argblock_free = *(char **)buf;
+		argblock_nfree--;
+	}
+	spinlock_release(&argblock_lock);
+
+	if (buf == NULL) {
+		buf = kmalloc(ARG_MAX);
+		if (buf == NULL) {
+			return ENOMEM;
+		}
+	}
+	ab->ab_buf = buf;
+	ab->ab_len = 0;
+	ab->ab_argc = 0;
+	return 0;
+}
+
+void
+argblock_cleanup(struct argblock *ab)
+{
+	char *buf;
+
+	buf = ab->ab_buf;
+	ab->ab_buf = NULL;
+
+	spinlock_acquire(&argblock_lock);
+	if (argblock_nfree < ARGBLOCK_NCACHE) {
+		*(char **)buf = argblock_free;
+		argblock_free = buf;
+		argblock_nfree++;
+		buf = NULL;
+	}
+	spinlock_release(&argblock_lock);
+
+	if (buf != NULL) {
+		kfree(buf);
+	}
+}
+
+/*
+ * Room left for the next string, counting its NUL, after making
+ * space for its argv slot.
+ */
+static
+size_t
+argblock_room(struct argblock *ab)
+{
+	size_t used;
+
+	used = argblock_size(ab->ab_len, ab->ab_argc + 1);
+	return used >= ARG_MAX ? 0 : ARG_MAX - used;
+}
+
+/*
+ * Account for a string of LEN bytes (with NUL) just put at the end.
+ * The padding can still push it over.
+ */
+static
+int
+argblock_commit(struct argblock *ab, size_t len)
+{
+	if (argblock_size(ab->ab_len + len, ab->ab_argc + 1) > ARG_MAX) {
+		return E2BIG;
+	}
+	ab->ab_len += len;
+	ab->ab_argc++;
+	return 0;
+}
+
+int
+argblock_add(struct argblock *ab, const char *arg)
+{
+	size_t len;
+
+	len = strlen(arg) + 1;
+	if (len > argblock_room(ab)) {
+		return E2BIG;
+	}
+	memcpy(ab->ab_buf + ab->ab_len, arg, len);
+	return argblock_commit(ab, len);
+}
+
+int
+argblock_copyin(struct argblock *ab, userptr_t uargv)
+{
+	userptr_t uarg;
+	size_t got;
+	int result;
+
+	while (1) {
+		result = copyin((const_userptr_t)uargv, &uarg, sizeof(uarg));
+		if (result) {
+			return result;
+		}
+		if (uarg == NULL) {
+			return 0;
+		}
+		result = copyinstr((const_userptr_t)uarg,
+				   ab->ab_buf + ab->ab_len,
+				   argblock_room(ab), &got);
+		if (result == ENAMETOOLONG) {
+			return E2BIG;
+		}
+		if (result) {
+			return result;
+		}
+		result = argblock_commit(ab, got);
+		if (result) {
+			return result;
+		}
+		uargv += sizeof(userptr_t);
+	}
+}
+
+int
+argblock_check(struct argblock *ab, size_t stacksize)
+{
+	size_t size;
+
+	size = ROUNDUP(argblock_size(ab->ab_len, ab->ab_argc), 8);
+	if (size > stacksize / 2) {
+		return E2BIG;
+	}
+	return 0;
+}
+
+int
+argblock_copyout(struct argblock *ab, vaddr_t *stackptr, userptr_t *uargv)
+{
+	userptr_t *argv;
+	vaddr_t base;
+	size_t strsize, size, pos;
+	unsigned i;
+
+	/* Keep the stack doubleword aligned, as the MIPS ABI wants. */
+	strsize = ROUNDUP(ab->ab_len, sizeof(userptr_t));
+	size = ROUNDUP(argblock_size(ab->ab_len, ab->ab_argc), 8);
+	KASSERT(size <= ARG_MAX);
+	base = *stackptr - size;
+
+	/* Zero the padding, so as not to leak kernel memory. */
+	bzero(ab->ab_buf + ab->ab_len, strsize - ab->ab_len);
+	bzero(ab->ab_buf + strsize, size - strsize);
+
+	argv = (userptr_t *)(ab->ab_buf + strsize);
+	pos = 0;
+	for (i=0; i<ab->ab_argc; i++) {
+		argv[i] = (userptr_t)(base + pos);
+		pos += strlen(ab->ab_buf + pos) + 1;
+	}
+	KASSERT(pos == ab->ab_len);
+	argv[ab->ab_argc] = NULL;
+
+	*stackptr = base;
+	*uargv = (userptr_t)(base + strsize);
+	return copyout(ab->ab_buf, (userptr_t)base, size);
+}
+
+/*
+ * Shrinker: free the cached buffers.
+ */
+static
+unsigned
+argblock_shrink(void *data, unsigned npages)
+{
+	char *list, *buf;
+	unsigned n;
+
+	(void)data;
+	(void)npages;
+
+	spinlock_acquire(&argblock_lock);
+	list = argblock_free;
+	n = argblock_nfree;
+	argblock_free = NULL;
+	argblock_nfree = 0;
+	spinlock_release(&argblock_lock);
+
+	while (list != NULL) {
+		buf = list;
+		list = *(char **)buf;
+		kfree(buf);
+	}
+	return n * (ARG_MAX / PAGE_SIZE);
+}
+
+void
+argblock_bootstrap(void)
+{
+	shrinker_register("argblock", argblock_shrink, NULL, 0);
+}
@@ -2,6 +2,8 @@
 #include <kern/errno.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <syscall.h>
 #include <current.h>
@@ -14,57 +16,233 @@
 #include <mips/trapframe.h>
 #include <vfs.h>
 #include <kern/fcntl.h>
+#include <argblock.h>
 #include "opt-A2.h"
 
   /* this implementation of sys__exit does not do anything with the exit code */
   /* this needs to be fixed to get exit() and waitpid() working properly */
 
-void sys__exit(int exitcode) {
+#if OPT_A2
+/*
+ * vfork support. A vfork child borrows its parent's address space
+ * instead of copying it, and the parent's thread sleeps until the
+ * child is done with it, which is when the child execs or exits:
+ * then vfork_release clears *vforkDone and wakes the parent on its
+ * childExit cv. Returns true if P was borrowing an address space, in
+ * which case it's the parent's to keep and P mustn't destroy it.
+ */
+static
+bool
+vfork_release(struct proc *p)
+{
+  if (p->vforkDone == NULL) {
+    // unlocked: only p itself ever sets or clears it after fork
+    return false;
+  }
+  lock_acquire(procFamilyLock);
+  *p->vforkDone = true;
+  cv_broadcast(p->vforkParent->childExit, procFamilyLock);
+  p->vforkDone = NULL;
+  p->vforkParent = NULL;
+  lock_release(procFamilyLock);
+  return true;
+}
+#endif
 
-  struct addrspace *as;
-  struct proc *p = curproc;
-  
 #if OPT_A2
+/*
+ * True if the current thread must leave P because another thread has
+ * called _exit or execv. Call with P's p_lock held.
+ */
+static
+bool
+proc_mustleave(struct proc *p)
+{
+  KASSERT(spinlock_do_i_hold(&p->p_lock));
+  return p->exiting ||
+    (p->execThread != NULL && p->execThread != curthread);
+}
 
-  // save exitcode for parent to retrieve
-  p->exitStatus = _MKWAIT_EXIT(exitcode);
+/*
+ * Tell P's other threads to leave (after setting exiting or
+ * execThread): wake any of them sleeping in waitpid, which then
+ * returns EINTR, so they reach proc_exitcheck on the way out.
+ */
+static
+void
+proc_kickthreads(struct proc *p)
+{
+  lock_acquire(procFamilyLock);
+  cv_broadcast(p->childExit, procFamilyLock);
+  lock_release(procFamilyLock);
+}
 
-  // For child, if parents live, wake them up
-  if (p->parent != -1){
-    cv_broadcast(p->waitExit, p->waitExitLock);
-  } 
+/*
+ * The way out for a thread of a user process, whether it called
+ * _exit or __threadexit or was caught by proc_exitcheck. Only the
+ * last thread to leave tears the process down; it reports the status
+ * given to the first _exit, or exit(0) if every thread just called
+ * __threadexit. Does not return.
+ */
+static
+void
+proc_leave(void)
+{
+  struct addrspace *as;
+  struct proc *p = curproc;
+  struct proc *child, *nextchild, *zombies;
+  struct schedstats ss;
+  bool orphan, execing;
+
+  // our user stack can go to the next __threadfork; but a vfork
+  // child's is on loan from the parent thread
+  if (curthread->t_ustack >= 0) {
+    if (p->vforkDone == NULL) {
+      as_release_threadstack(p->p_addrspace, curthread->t_ustack);
+    }
+    curthread->t_ustack = -1;
+  }
 
-  // For parents, find children,
-  unsigned int n = array_num(processArray);
-  for (unsigned int i = 0; i < n; i++){
-    struct proc *pidProc = array_get(processArray, i);
-    if (pidProc == NULL) {
-        continue;
+  /* detach this thread from its process */
+  /* note: curproc cannot be used after this call */
+  if (proc_remthread(curthread) > 0) {
+    // others are still running in the process; leave it to them,
+    // letting a thread in execv know one fewer is in its way
+    spinlock_acquire(&p->p_lock);
+    execing = p->execThread != NULL;
+    spinlock_release(&p->p_lock);
+    if (execing) {
+      proc_kickthreads(p);
     }
-    if (p->pid == pidProc->parent){
-      
-      // if any live children, detach the children and parent relationship
-      if (pidProc->exitStatus != -1){
-        pidProc->parent = -1;
-      }
-	    // release children's exit lock, so that they can exit
-      lock_release(pidProc->exitLock); 
+    thread_exit();
+  }
+
+  // We were the last thread, so nothing runs in the address space
+  // any more and nothing else can join p.
+  as_deactivate();
+  /*
+   * clear p_addrspace before calling as_destroy. Otherwise if
+   * as_destroy sleeps (which is quite possible) when we
+   * come back we'll be calling as_activate on a
+   * half-destroyed address space. This tends to be
+   * messily fatal.
+   */
+  spinlock_acquire(&p->p_lock);
+  as = p->p_addrspace;
+  p->p_addrspace = NULL;
+  spinlock_release(&p->p_lock);
+  KASSERT(as != NULL);
+  // a vfork child hands the address space back instead
+  if (!vfork_release(p)) {
+    as_destroy_deferred(as);
+  }
+
+  // Nothing of ours runs any more, so p can now be handed over. Our
+  // zombie children have nobody else to reap them, so we destroy
+  // them; live ones are orphaned and will destroy themselves. Costs
+  // O(our children), however many processes the system has run.
+  zombies = NULL;
+  lock_acquire(procFamilyLock);
+  for (child = p->children; child != NULL; child = nextchild) {
+    nextchild = child->nextSibling;
+    child->nextSibling = child->prevSibling = NULL;
+    child->parentProc = NULL;
+    child->parent = -1;
+    if (child->exitStatus != -1) {
+      child->nextSibling = zombies;
+      zombies = child;
     }
   }
-  // For child, if my parent is died, fully delete myself, b/c no parent can call waitpid
-  // For parent, fully delete myself
-  // Meaning, if no living parent, fully delete themself
-  // proc_destroy(p);
-  
-  
+  p->children = NULL;
+
+  // save exitcode for parent to retrieve, charge it our cpu time
+  // (and our children's), and wake it if it's waiting for us. From
+  // here on p belongs to the parent, which destroys it when it reaps.
+  p->exitStatus = p->exiting ? p->exitCode : _MKWAIT_EXIT(0);
+  orphan = (p->parentProc == NULL);
+  if (!orphan) {
+    proc_getstats(p, &ss);
+    spinlock_acquire(&p->p_lock);
+    schedstats_add(&ss, &p->p_cstats);
+    spinlock_release(&p->p_lock);
+    spinlock_acquire(&p->parentProc->p_lock);
+    schedstats_add(&p->parentProc->p_cstats, &ss);
+    spinlock_release(&p->parentProc->p_lock);
+    cv_broadcast(p->parentProc->childExit, procFamilyLock);
+  }
+  lock_release(procFamilyLock);
+
+  while (zombies != NULL) {
+    child = zombies;
+    zombies = child->nextSibling;
+    child->nextSibling = NULL;
+    proc_destroy(child);
+  }
+
+  /* if this is the last user process in the system, proc_destroy()
+     will wake up the kernel menu thread */
+  if (orphan) {
+    proc_destroy(p);
+  }
+
+  thread_exit();
+  /* thread_exit() does not return, so we should never get here */
+  panic("return from thread_exit in proc_leave\n");
+}
+
+/*
+ * If another thread has called _exit or execv, the current one leaves.
+ * mips_trap calls this before returning to user mode, so a thread
+ * that is running user code goes at its next trap or interrupt. One
+ * blocked in waitpid is woken (see proc_kickthreads) and goes on its
+ * way out of the call. Other system calls run to completion first;
+ * none of them blocks for long except a vfork parent's wait for its
+ * child, which can't be cut short as the child is using its memory.
+ */
+void
+proc_exitcheck(void)
+{
+  struct proc *p = curproc;
+  bool leave;
+
+  if (p == NULL) {
+    return;
+  }
+  spinlock_acquire(&p->p_lock);
+  leave = proc_mustleave(p);
+  spinlock_release(&p->p_lock);
+  if (leave) {
+    proc_leave();
+  }
+}
+#endif
+
+void sys__exit(int exitcode) {
+
+#if OPT_A2
+  bool others;
 #else
-  /* for now, just include this to keep the compiler from complaining about
-     an unused variable */
-  (void)exitcode;
+  struct addrspace *as;
 #endif
+  struct proc *p = curproc;
 
   DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
 
+#if OPT_A2
+  // The whole process exits, with the code from the first _exit;
+  // any other threads notice and follow (see proc_exitcheck).
+  spinlock_acquire(&p->p_lock);
+  if (!p->exiting) {
+    p->exiting = true;
+    p->exitCode = _MKWAIT_EXIT(exitcode);
+  }
+  others = threadarray_num(&p->p_threads) > 1;
+  spinlock_release(&p->p_lock);
+  if (others) {
+    proc_kickthreads(p);
+  }
+  proc_leave();
+#else
   KASSERT(curproc->p_addrspace != NULL);
   as_deactivate();
   /*
@@ -75,23 +253,22 @@ void sys__exit(int exitcode) {
    * messily fatal.
    */
   as = curproc_setas(NULL);
-  as_destroy(as);
+  as_destroy_deferred(as);
 
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
   proc_remthread(curthread);
 
-#if OPT_A2
-  // prevent child process exit before parent process
-  lock_acquire(p->exitLock);
-  lock_release(p->exitLock);
-#endif
+  /* for now, just include this to keep the compiler from complaining about
+     an unused variable */
+  (void)exitcode;
 
   /* if this is the last user process in the system, proc_destroy()
      will wake up the kernel menu thread */
   proc_destroy(p);
   
   thread_exit();
+#endif
   /* thread_exit() does not return, so we should never get here */
   panic("return from thread_exit in sys_exit\n");
 }
@@ -127,38 +304,80 @@ sys_waitpid(pid_t pid,
   int exitstatus;
   int result;
   
-  if (options != 0) {
+  if ((options & ~WNOHANG) != 0) {
     return(EINVAL);
   }
 #if OPT_A2
   struct proc *p = curproc;
-  struct proc *pidProc = array_get(processArray, pid);
-  // pid is not your child
-  if (pidProc->parent != p->pid){
-    return ECHILD;
-  }
-  // The pid argument named a nonexistent process.
-  if (pidProc == NULL){
-    return ESRCH;
-  }
+  struct proc *pidProc;
+  bool leave;
+
   // The status argument was an invalid pointer.
   if(status == NULL){
     return EFAULT;
   }
-  
-  
-  // while the child hasn't exited, go to sleep.
-  // cv on the child process
-  lock_acquire(pidProc->waitExitLock);
-  while (pidProc->exitStatus == -1){
-    cv_wait(pidProc->waitExit, pidProc->waitExitLock); 
+
+  // Look for the child (or with WAIT_ANY, any child that has exited)
+  // on our own list, and sleep on our childExit cv until one of our
+  // children exits. Recheck after each wakeup: it may not be the one
+  // we want, and with more than one thread in a process, another one
+  // may have reaped it meanwhile.
+  lock_acquire(procFamilyLock);
+  while (1) {
+    if (pid == WAIT_ANY) {
+      if (p->children == NULL) {
+        lock_release(procFamilyLock);
+        return ECHILD;
+      }
+      pidProc = proc_findzombie(p);
+    }
+    else {
+      pidProc = proc_findchild(p, pid);
+      if (pidProc == NULL) {
+        lock_release(procFamilyLock);
+        // ESRCH if the pid named no process, ECHILD if not our child
+        rwlock_acquire_read(processTableLock);
+        result = proc_lookup(pid) == NULL ? ESRCH : ECHILD;
+        rwlock_release_read(processTableLock);
+        return result;
+      }
+      if (pidProc->exitStatus == -1) {
+        pidProc = NULL;
+      }
+    }
+    if (pidProc != NULL) {
+      break;
+    }
+    if (options & WNOHANG) {
+      // nothing to reap yet; status is left alone
+      lock_release(procFamilyLock);
+      *retval = 0;
+      return 0;
+    }
+    // don't hold up another thread's _exit or execv
+    spinlock_acquire(&p->p_lock);
+    leave = proc_mustleave(p);
+    spinlock_release(&p->p_lock);
+    if (leave) {
+      lock_release(procFamilyLock);
+      return EINTR;
+    }
+    cv_wait(p->childExit, procFamilyLock);
   }
-  // get the exitstatus from child
+  // Hand back the exit status first, still under procFamilyLock so
+  // no other thread reaps the child meanwhile; if that fails, leave
+  // the zombie so the status can be collected by a retry.
   exitstatus = pidProc->exitStatus;
-  lock_release(pidProc->waitExitLock);
-
-  // Parent get the child's exit code, allow the child to exit
-  //lock_release(pidProc->exitLock);
+  result = copyout((void *)&exitstatus,status,sizeof(int));
+  if (result) {
+    lock_release(procFamilyLock);
+    return(result);
+  }
+  *retval = pidProc->pid;
+  proc_remchild(pidProc);
+  lock_release(procFamilyLock);
+  proc_destroy(pidProc);
+  return(0);
 
 #else
   /* this is just a stub implementation that always reports an
@@ -172,7 +391,6 @@ sys_waitpid(pid_t pid,
 
   /* for now, just pretend the exitstatus is 0 */
   exitstatus = 0;
-#endif 
 
   result = copyout((void *)&exitstatus,status,sizeof(int));
   if (result) {
@@ -180,14 +398,24 @@ sys_waitpid(pid_t pid,
   }
   *retval = pid;
   return(0);
+#endif 
 }
 
 #if OPT_A2
 
+/*
+ * Common code for fork and vfork. With BORROW the child shares our
+ * address space, and we don't return until it has let go of it.
+ */
+static
 int
-sys_fork(pid_t *retval, struct trapframe *tf) { 
+fork_common(pid_t *retval, struct trapframe *tf, bool borrow) { 
+  struct addrspace *newas;
+  bool vforkDone;
+  int result;
+
   //There are already too many processes on the system.
-  if (array_num(processArray) >= __PID_MAX) {
+  if (proc_tablefull()) {
     // EMPROC - The current user already has too many processes.
     // Since there is only one user, EMPROC and ENPROC are the same.
     return ENPROC;
@@ -196,22 +424,26 @@ sys_fork(pid_t *retval, struct trapframe *tf) {
   /* Create process structure for child process */
   struct proc *childProc = proc_create_runprogram("childProc");
   if (childProc == NULL) {
-      return ENOMEM;
+      // the check above was only a hint; the table may have filled since
+      return proc_tablefull() ? ENPROC : ENOMEM;
   }
-  lock_acquire(childProc->exitLock);
-  
-  /* Create and copy address space */
-  struct addrspace *oldas = curproc->p_addrspace;
-  struct addrspace *newas;
-  // as_copy: creates a new address spaces, and copies 
-  // the pages from the old address space to the new one
-  int as_copy_status = as_copy(oldas, &newas);
-  // if as_copy return an error
-  if (as_copy_status != 0){
-      kfree(oldas);
-      kfree(newas);
+
+  if (borrow) {
+    // no copy; the child runs in our address space until it execs
+    newas = curproc->p_addrspace;
+    vforkDone = false;
+    childProc->vforkParent = curproc;
+    childProc->vforkDone = &vforkDone;
+  }
+  else {
+    /* Create and copy address space */
+    // as_copy: creates a new address spaces, and copies 
+    // the pages from the old address space to the new one
+    result = as_copy(curproc->p_addrspace, &newas);
+    if (result) {
       proc_destroy(childProc);
-      return as_copy_status;
+      return result;
+    }
   }
 
   // associate address space with the child process
@@ -219,13 +451,12 @@ sys_fork(pid_t *retval, struct trapframe *tf) {
   childProc->p_addrspace = newas;
   spinlock_release(&childProc->p_lock);
 
-  //DEBUG(DB_LOCORE,"Fork118: oldas(%d) newas(%d)\n",oldas->as_vbase1,newas->as_vbase1);
+  // child gets the parent's scheduling share, and starts level with it
+  childProc->p_tickets = curproc->p_tickets;
+  childProc->p_pass = curproc->p_pass;
+
   DEBUG(DB_LOCORE,"Fork202: childProc->pid = %d \n", childProc->pid);
   DEBUG(DB_LOCORE,"Fork202: curProc->pid = %d \n", curproc->pid);
-  /* Create the parent/child relationship */
-  // current process's pid
-  childProc->parent = curproc->pid;
-
   /* Create thread for child process */
 
   // Can we just pass the parent's trapframe pointer to thread_fork?
@@ -234,144 +465,426 @@ sys_fork(pid_t *retval, struct trapframe *tf) {
   // and pass a pointer to the copy into the entrypoint function.
   struct trapframe *childTf = kmalloc(sizeof(struct trapframe));
   if(childTf == NULL){
-    proc_destroy(childProc);
-    return ENOMEM;
+    result = ENOMEM;
+    goto fail;
   }
   *childTf = *tf;
-  // create a new thread
-  int forkResult = thread_fork("childProc", childProc, enter_forked_process, childTf, 0);
-  if(forkResult != 0){
-    kfree(oldas);
-    kfree(newas);
+
+  /* Create the parent/child relationship */
+  // before the child runs, so that it can't exit unseen
+  proc_addchild(curproc, childProc);
+
+  // once it runs, the child may exit and be reaped at any time
+  *retval = childProc->pid;
+
+  // create a new thread; it runs on the same user stack as we do
+  result = thread_fork("childProc", childProc, enter_forked_process, childTf,
+                       curthread->t_ustack);
+  if (result) {
+    lock_acquire(procFamilyLock);
+    proc_remchild(childProc);
+    lock_release(procFamilyLock);
     kfree(childTf);
-    proc_destroy(childProc);
-    return forkResult;
+    goto fail;
   }
 
-  *retval = childProc->pid;
+  if (borrow) {
+    // childProc may already be gone; only vforkDone is ours
+    lock_acquire(procFamilyLock);
+    while (!vforkDone) {
+      cv_wait(curproc->childExit, procFamilyLock);
+    }
+    lock_release(procFamilyLock);
+  }
+  return 0;
+
+ fail:
+  childProc->p_addrspace = NULL;
+  if (!borrow) {
+    as_destroy(newas);
+  }
+  childProc->vforkParent = NULL;
+  childProc->vforkDone = NULL;
+  proc_destroy(childProc);
+  return result;
+}
+
+int
+sys_fork(pid_t *retval, struct trapframe *tf) { 
+  return fork_common(retval, tf, false);
+}
+
+/*
+ * vfork: fork without copying the address space. Until the child
+ * calls execv or _exit it runs on our memory (and our user stack),
+ * and we sleep; see vfork_release. So it must not return from the
+ * function that called vfork or modify anything it hasn't set up
+ * itself. For the usual fork-then-exec this saves building and then
+ * tearing down a copy of the whole address space.
+ */
+int
+sys_vfork(pid_t *retval, struct trapframe *tf) { 
+  return fork_common(retval, tf, true);
+}
+
+/*
+ * __threadfork: start another thread in the calling process, running
+ * ENTRY(ARG) on a user stack of its own, with the same registers as
+ * us otherwise. It shares everything with the other threads; it
+ * leaves with __threadexit, and when the last thread has left the
+ * process exits. The stack slots are limited (AS_NTHREADSTACKS), and
+ * a vfork child, which is on loan its parent's memory, can't have any.
+ */
+int
+sys___threadfork(userptr_t entry, userptr_t arg, struct trapframe *tf)
+{
+  struct addrspace *as = curproc->p_addrspace;
+  struct trapframe *newTf;
+  vaddr_t stackptr;
+  int slot;
+  int result;
+
+  if (curproc->vforkDone != NULL) {
+    return EINVAL;
+  }
+
+  result = as_define_threadstack(as, &slot, &stackptr);
+  if (result) {
+    return result;
+  }
+
+  // copied for the same reason as fork's; see enter_new_thread
+  newTf = kmalloc(sizeof(struct trapframe));
+  if (newTf == NULL) {
+    as_release_threadstack(as, slot);
+    return ENOMEM;
+  }
+  *newTf = *tf;
+  newTf->tf_epc = (vaddr_t)entry;
+  newTf->tf_a0 = (vaddr_t)arg;
+  newTf->tf_ra = 0;
+  // leave room for ENTRY to save its argument registers
+  newTf->tf_sp = stackptr - 16;
+
+  result = thread_fork(curthread->t_name, curproc, enter_new_thread, newTf,
+                       slot);
+  if (result) {
+    kfree(newTf);
+    as_release_threadstack(as, slot);
+    return result;
+  }
   return 0;
 }
+
+/*
+ * __threadexit: the calling thread leaves; see sys___threadfork.
+ */
+void
+sys___threadexit(void)
+{
+  proc_leave();
+}
 #endif
 
 
 #if OPT_A2
 
+/*
+ * Look up the target of settickets/setaffinity: the calling process
+ * (pid 0 or its own pid) or one of its children. A child is returned
+ * with processTableLock held for reading, so it can't be destroyed until the
+ * caller is done with it and releases the lock.
+ */
+static
 int
-sys_execv(const_userptr_t progname, userptr_t args) { 
-  /* Count the number of arguments and copy them into the kernel */
-  int i = 0;            // Number of arguments
-  size_t argsSize = 0;  // Total size of all arguments
-  while (((char**)args)[i] != NULL){
-    argsSize += strlen(((char**)args)[i]) + 1;
-    i ++;  
-  }
-
-  // Create the argv array in the user program's address space
-  char **argsArray = kmalloc(sizeof(char *) * argsSize + 1);
-  argsArray[i] = NULL;
-  for (int j = 0; j < i; j++ ){
-    size_t argLength = strlen(((char**)args)[j]) + 1;
-    argsArray[j] = kmalloc(sizeof(char) * argLength);
-    // Copy arguments to the kernel
-    copyinstr((const_userptr_t)(((char**)args)[j]), argsArray[j], argLength, &argLength); 
-  }
- 
-  for (int j=0; j<=i; j++) {
-    const char *tmp = argsArray[j];
-    if (tmp == NULL) {
-      tmp = "[NULL]";
+sched_getproc(pid_t pid, struct proc **ret)
+{
+  struct proc *p;
+
+  if (pid == 0 || pid == curproc->pid) {
+    *ret = curproc;
+    return 0;
+  }
+
+  rwlock_acquire_read(processTableLock);
+  p = proc_lookup(pid);
+  if (p == NULL) {
+    rwlock_release_read(processTableLock);
+    return ESRCH;
+  }
+  if (p->parent != curproc->pid) {
+    rwlock_release_read(processTableLock);
+    return EPERM;
+  }
+  *ret = p;
+  return 0;
+}
+
+/*
+ * settickets: set the stride-scheduling share of a process (see
+ * sched_getproc for which). Returns the old ticket count.
+ */
+int
+sys_settickets(pid_t pid, int tickets, int32_t *retval)
+{
+  struct proc *p;
+  int result;
+
+  if (tickets < 1 || tickets > PROC_MAXTICKETS) {
+    return EINVAL;
+  }
+
+  result = sched_getproc(pid, &p);
+  if (result) {
+    return result;
+  }
+  spinlock_acquire(&p->p_lock);
+  *retval = p->p_tickets;
+  p->p_tickets = tickets;
+  spinlock_release(&p->p_lock);
+  if (p != curproc) {
+    rwlock_release_read(processTableLock);
+  }
+  return 0;
+}
+
+/*
+ * setaffinity: restrict the threads of a process (see sched_getproc
+ * for which) to the cpus whose bits are set in MASK.
+ */
+int
+sys_setaffinity(pid_t pid, uint32_t mask)
+{
+  struct proc *p;
+  struct thread *t;
+  unsigned i, num;
+  int result;
+
+  result = sched_getproc(pid, &p);
+  if (result) {
+    return result;
+  }
+
+  spinlock_acquire(&p->p_lock);
+  num = threadarray_num(&p->p_threads);
+  for (i = 0; i < num && result == 0; i++) {
+    t = threadarray_get(&p->p_threads, i);
+    if (t != curthread) {
+      result = thread_setaffinity(t, mask);
     }
-    DEBUG(DB_LOCORE,"argsArray[%d] -> %s\n", j, tmp);
+  }
+  spinlock_release(&p->p_lock);
+  if (p != curproc) {
+    rwlock_release_read(processTableLock);
+    return result;
   }
 
- 
-  /* Copy the program path into the kernel */
-  size_t progLength = strlen((char *)progname) + 1;
-  char *progPath = kmalloc(sizeof(char) * progLength);
-  copyinstr(progname, progPath, progLength, &progLength); 
+  // moving ourselves may sleep, so do it without p_lock
+  if (result == 0) {
+    result = thread_setaffinity(curthread, mask);
+  }
+  return result;
+}
+
+/*
+ * getrusage: cpu time and context switches of the calling process
+ * (RUSAGE_SELF) or of its children that have exited (RUSAGE_CHILDREN).
+ * We don't tell user time from system time; it is all in ru_utime.
+ * Wait times and migrations are only shown by the "ss" menu command.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+  struct schedstats ss;
+  struct rusage ru;
+
+  switch (who) {
+  case RUSAGE_SELF:
+    proc_getstats(curproc, &ss);
+    break;
+  case RUSAGE_CHILDREN:
+    spinlock_acquire(&curproc->p_lock);
+    ss = curproc->p_cstats;
+    spinlock_release(&curproc->p_lock);
+    break;
+  default:
+    return EINVAL;
+  }
+
+  bzero(&ru, sizeof(ru));
+  ru.ru_utime.tv_sec = ss.ss_runtime / 1000000000;
+  ru.ru_utime.tv_usec = (ss.ss_runtime % 1000000000) / 1000;
+  ru.ru_nvcsw = ss.ss_nvcsw;
+  ru.ru_nivcsw = ss.ss_nivcsw;
+  return copyout(&ru, usage, sizeof(ru));
+}
+
+#endif
+
+#if OPT_A2
 
+/*
+ * For execv: end the calling process's other threads, as _exit would,
+ * and wait until they have left. If another thread has called _exit
+ * or execv first, we leave instead (dropping V, PATH and AB), and
+ * don't return.
+ */
+static
+void
+exec_endthreads(struct vnode *v, char *path, struct argblock *ab)
+{
+  struct proc *p = curproc;
+  unsigned nthreads;
+  bool leave;
+
+  spinlock_acquire(&p->p_lock);
+  nthreads = threadarray_num(&p->p_threads);
+  leave = proc_mustleave(p);
+  if (!leave && nthreads > 1) {
+    p->execThread = curthread;
+  }
+  spinlock_release(&p->p_lock);
+  if (!leave && nthreads == 1) {
+    // the usual case; only a thread of ours could make another
+    return;
+  }
+
+  if (!leave) {
+    // like proc_kickthreads, but stay to wait for them to go
+    lock_acquire(procFamilyLock);
+    cv_broadcast(p->childExit, procFamilyLock);
+    while (1) {
+      spinlock_acquire(&p->p_lock);
+      nthreads = threadarray_num(&p->p_threads);
+      leave = p->exiting;
+      if (nthreads == 1 || leave) {
+        p->execThread = NULL;
+      }
+      spinlock_release(&p->p_lock);
+      if (nthreads == 1 || leave) {
+        break;
+      }
+      cv_wait(p->childExit, procFamilyLock);
+    }
+    lock_release(procFamilyLock);
+    if (!leave) {
+      return;
+    }
+  }
+
+  vfs_close(v);
+  kfree(path);
+  argblock_cleanup(ab);
+  proc_leave();
+}
+
+int
+sys_execv(const_userptr_t progname, userptr_t args) { 
+  struct argblock ab;
   struct addrspace *as; // New address space
+  struct addrspace *oldas;
   struct vnode *v;
   vaddr_t entrypoint, stackptr;
+  userptr_t argv;
+  unsigned argc;
+  char *progPath;
   int result;
 
+  /* Copy the program path into the kernel */
+  progPath = kmalloc(PATH_MAX);
+  if (progPath == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(progname, progPath, PATH_MAX, NULL);
+  if (result) {
+    kfree(progPath);
+    return result;
+  }
+
+  /* Copy the arguments into the kernel, all into one buffer */
+  result = argblock_init(&ab);
+  if (result) {
+    kfree(progPath);
+    return result;
+  }
+  result = argblock_copyin(&ab, args);
+  if (result) {
+    goto fail;
+  }
+  // ARG_MAX is more than some stacks hold; find out while we can
+  // still fail back to the old program
+  result = argblock_check(&ab, as_stacksize(curproc_getas()));
+  if (result) {
+    goto fail;
+  }
+
   /* Open the file. */
   result = vfs_open(progPath, O_RDONLY, 0, &v);
   if (result) {
-    return result;
+    goto fail;
   }
 
-  /* We should be a new process. */
-  // KASSERT(curproc_getas() == NULL);
+  // The address space is about to be replaced under any other
+  // threads; end them first. (So they're gone even if we fail
+  // from here on, as they would be after a successful exec.)
+  exec_endthreads(v, progPath, &ab);
 
   /* Create a new address space. */
   as = as_create();
   if (as ==NULL) {
     vfs_close(v);
-    return ENOMEM;
+    result = ENOMEM;
+    goto fail;
   }
 
   /* Switch to it and activate it. */
-  struct addrspace *oldas = curproc_setas(as);
+  oldas = curproc_setas(as);
   as_activate();
 
   /* Load the executable. */
   result = load_elf(v, &entrypoint);
-  if (result) {
-    /* p_addrspace will go away when curproc is destroyed */
-    vfs_close(v);
-    return result;
-  }
   
   /* Done with the file now. */
   vfs_close(v);
 
-  /* Define the user stack in the address space */
-  result = as_define_stack(as, &stackptr);
-  if (result) {
-    /* p_addrspace will go away when curproc is destroyed */
-    return result;
+  /* Define the user stack, and put the arguments on it */
+  if (result == 0) {
+    result = as_define_stack(as, &stackptr);
   }
-
-  /* Need to copy the arguments into the new address space. 
-  Consider copying the arguments (both the array and the strings) 
-  onto the user stack (as part of as_define_stack.) */
-
-  // Copy each arg string and then place them on the new stack of newly created user space. 
-  vaddr_t argsPointer[i];
-  argsPointer[i] = 0;
-  for (int j = i - 1; j >= 0; j--){
-    size_t argLength = strlen(argsArray[j]) + 1;
-    stackptr -= argLength;
-    argsPointer[j] = stackptr;
-    copyoutstr(argsArray[j], (userptr_t)stackptr, argLength, &argLength);
-    DEBUG(DB_LOCORE,"stackptr[%d] -> %p\n", j, (userptr_t)stackptr);
+  if (result == 0) {
+    result = argblock_copyout(&ab, &stackptr, &argv);
   }
-  // Place pointers on the stack which point to these arg strings.
-  stackptr -= stackptr % 4;
-  for(int j = i; j >= 0; j--){
-    stackptr -= ROUNDUP(sizeof(vaddr_t),4);
-    copyout(&argsPointer[j],(userptr_t)stackptr,sizeof(vaddr_t));
-    DEBUG(DB_LOCORE,"stackptr[%d] -> %p\n", j, (userptr_t)stackptr);
+  if (result) {
+    /* go back to the old address space, which may be borrowed */
+    curproc_setas(oldas);
+    as_activate();
+    as_destroy(as);
+    goto fail;
   }
 
+  argc = ab.ab_argc;
   kfree(progPath);
-  for (int j = 0; j < i; j++){
-    kfree(argsArray[j]);
-  }
-  kfree(argsArray);
+  argblock_cleanup(&ab);
 
-  /* Delete old address space */
-  as_destroy(oldas);
+  /* Delete old address space, or give it back after vfork */
+  if (!vfork_release(curproc)) {
+    as_destroy_deferred(oldas);
+  }
+  // whichever stack we were on is gone; we're on the new main one
+  curthread->t_ustack = -1;
   
   /* Warp to user mode. */
-  enter_new_process(i /*argc*/, (userptr_t)stackptr /*userspace addr of argv*/,
+  enter_new_process(argc /*argc*/, argv /*userspace addr of argv*/,
         stackptr, entrypoint);
   
   /* enter_new_process does not return. */
   panic("enter_new_process returned\n");
   return EINVAL;
 
+ fail:
+  kfree(progPath);
+  argblock_cleanup(&ab);
+  return result;
 }
 #endif
 
@@ -45,6 +45,7 @@
 #include <syscall.h>
 #include <test.h>
 #include <copyinout.h>
+#include <argblock.h>
 
 /*
  * Load program "progname" and start running it in usermode.
@@ -59,6 +60,15 @@ runprogram(char *progname, unsigned long nargs, char **args)
 	struct vnode *v;
 	vaddr_t entrypoint, stackptr;
 	int result;
+#if OPT_A2
+	struct argblock ab;
+	userptr_t argv;
+	unsigned long i;
+
+#else
+	(void)nargs;
+	(void)args;
+#endif
 
 	/* Open the file. */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
@@ -99,26 +109,28 @@ runprogram(char *progname, unsigned long nargs, char **args)
 	}
 
 #if OPT_A2
-        vaddr_t argsPointer[nargs];
-	argsPointer[nargs] = 0;
-	for (int j = nargs - 1; j >= 0; j--){
-		size_t argLength = strlen(args[j]) + 1;
-		stackptr -= argLength;
-		argsPointer[j] = stackptr;
-		copyoutstr(args[j], (userptr_t)stackptr, argLength, &argLength);
-		DEBUG(DB_LOCORE,"stackptr[%d] -> %p\n", j, (userptr_t)stackptr);
+	/* Put the arguments on the stack, the same way execv does. */
+	result = argblock_init(&ab);
+	if (result) {
+		return result;
 	}
-	// Place pointers on the stack which point to these arg strings.
-	stackptr -= stackptr % 4;
-	for(int j = nargs; j >= 0; j--){
-		stackptr -= ROUNDUP(sizeof(vaddr_t),4);
-		copyout(&argsPointer[j],(userptr_t)stackptr,sizeof(vaddr_t));
-		DEBUG(DB_LOCORE,"stackptr[%d] -> %p\n", j, (userptr_t)stackptr);
+	for (i=0; i<nargs && result == 0; i++) {
+		result = argblock_add(&ab, args[i]);
+	}
+	if (result == 0) {
+		result = argblock_check(&ab, as_stacksize(as));
+	}
+	if (result == 0) {
+		result = argblock_copyout(&ab, &stackptr, &argv);
+	}
+	argblock_cleanup(&ab);
+	if (result) {
+		/* p_addrspace will go away when curproc is destroyed */
+		return result;
 	}
-
 
 	/* Warp to user mode. */
-	enter_new_process(nargs /*argc*/, (userptr_t)stackptr /*userspace addr of argv*/,
+	enter_new_process(nargs /*argc*/, argv /*userspace addr of argv*/,
 			  stackptr, entrypoint);
 #else
 	/* Warp to user mode. */
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Affinity test.
+ *
+ * Check that a thread leaves a cpu its affinity no longer allows even
+ * when nothing else wants that cpu: first a thread that moves itself
+ * off cpu 0, then a CPU-bound thread alone on cpu 0 that is moved by
+ * somebody else and only ever gives up the cpu by being timesliced.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <test.h>
+
+#define AFFSPINS	1000000	/* work done on cpu 0 before moving */
+
+static struct semaphore *aff_sem;
+static struct thread *volatile aff_spinner;
+static volatile unsigned aff_cpu;	/* where the spinner last was */
+static volatile bool aff_stop;
+static unsigned aff_failures;
+
+static
+void
+afftest_fail(const char *what, unsigned cpu)
+{
+	kprintf("afftest: %s: on cpu%u; test failed\n", what, cpu);
+	aff_failures++;
+}
+
+/* Pin curthread to cpu 0, and check that it got there. */
+static
+void
+afftest_pin0(const char *what)
+{
+	int result;
+
+	result = thread_setaffinity(curthread, 1);
+	if (result) {
+		panic("afftest: thread_setaffinity: %s\n", strerror(result));
+	}
+	if (curcpu->c_number != 0) {
+		afftest_fail(what, curcpu->c_number);
+	}
+}
+
+static
+void
+afftest_self(void *data, unsigned long allmask)
+{
+	volatile unsigned i;
+	int result;
+
+	(void)data;
+
+	afftest_pin0("pinning to cpu 0");
+	for (i=0; i<AFFSPINS; i++) {
+		/* nothing */
+	}
+	result = thread_setaffinity(curthread, allmask & ~(uint32_t)1);
+	if (result) {
+		panic("afftest: thread_setaffinity: %s\n", strerror(result));
+	}
+	if (curcpu->c_number == 0) {
+		afftest_fail("moving self off cpu 0", 0);
+	}
+	V(aff_sem);
+}
+
+static
+void
+afftest_spin(void *data, unsigned long junk)
+{
+	(void)data;
+	(void)junk;
+
+	afftest_pin0("pinning spinner to cpu 0");
+	aff_spinner = curthread;
+	V(aff_sem);
+	while (!aff_stop) {
+		aff_cpu = curcpu->c_number;
+	}
+	V(aff_sem);
+}
+
+int
+affinitytest(int nargs, char **args)
+{
+	unsigned ncpus;
+	uint32_t allmask;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	ncpus = thread_numcpus();
+	if (ncpus < 2) {
+		kprintf("afftest: needs at least 2 cpus\n");
+		return 0;
+	}
+	allmask = ncpus >= 32 ? THREAD_AFFINITY_ANY :
+		((uint32_t)1 << ncpus) - 1;
+
+	aff_sem = sem_create("afftest", 0);
+	if (aff_sem == NULL) {
+		panic("afftest: sem_create failed\n");
+	}
+	aff_failures = 0;
+
+	kprintf("Moving a thread off cpu 0 by itself...\n");
+	result = thread_fork("afftest", NULL, afftest_self, NULL, allmask);
+	if (result) {
+		panic("afftest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(aff_sem);
+
+	kprintf("Moving a spinning thread off cpu 0...\n");
+	aff_stop = false;
+	aff_cpu = 0;
+	result = thread_fork("afftest", NULL, afftest_spin, NULL, 0);
+	if (result) {
+		panic("afftest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(aff_sem);
+	result = thread_setaffinity(aff_spinner, allmask & ~(uint32_t)1);
+	if (result) {
+		panic("afftest: thread_setaffinity: %s\n", strerror(result));
+	}
+	/* plenty of timeslices */
+	clocksleep(1);
+	if (aff_cpu == 0) {
+		afftest_fail("spinner after 1 second", 0);
+	}
+	aff_stop = true;
+	P(aff_sem);
+
+	sem_destroy(aff_sem);
+	kprintf("Affinity test %s.\n", aff_failures ? "failed" : "done");
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Atomics test and semaphore fast-path benchmark.
+ *
+ * First, one thread per cpu hammers a shared counter with atomic_add
+ * and another with an atomic_cas retry loop; neither may lose an
+ * update. Then we time uncontended P/V pairs, which should stay on
+ * the lock-free fast path, against lock and spinlock round trips.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <test.h>
+
+#define MAXATOMICCPUS 32
+#define NATOMICLOOPS  20000
+#define NBENCHLOOPS   100000
+
+static volatile unsigned addcounter;
+static volatile unsigned cascounter;
+static struct semaphore *atomic_donesem;
+
+static
+void
+atomicthread(void *junk, unsigned long num)
+{
+	unsigned i, old;
+
+	(void)junk;
+
+	/* spread out over the cpus; if this fails we just share one */
+	thread_setaffinity(curthread, 1U << num);
+
+	for (i=0; i<NATOMICLOOPS; i++) {
+		atomic_add(&addcounter, 1);
+		do {
+			old = cascounter;
+		} while (!atomic_cas(&cascounter, old, old + 1));
+	}
+	V(atomic_donesem);
+}
+
+/*
+ * Return the nanoseconds elapsed since SECS/NSECS.
+ */
+static
+uint64_t
+elapsed(time_t secs, uint32_t nsecs)
+{
+	time_t secs2;
+	uint32_t nsecs2;
+
+	gettime(&secs2, &nsecs2);
+	return (uint64_t)(secs2 - secs) * 1000000000ULL + nsecs2 - nsecs;
+}
+
+int
+atomicbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct lock *lock;
+	struct spinlock spin;
+	unsigned i, ncpus, expected;
+	time_t secs;
+	uint32_t nsecs;
+	uint64_t ns;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	ncpus = thread_numcpus();
+	if (ncpus > MAXATOMICCPUS) {
+		ncpus = MAXATOMICCPUS;
+	}
+
+	atomic_donesem = sem_create("atomicdone", 0);
+	sem = sem_create("atomicbench", 1);
+	lock = lock_create("atomicbench");
+	if (atomic_donesem == NULL || sem == NULL || lock == NULL) {
+		panic("atomicbench: out of memory\n");
+	}
+	spinlock_init(&spin);
+
+	kprintf("Starting atomics test on %u cpus...\n", ncpus);
+	addcounter = cascounter = 0;
+	for (i=0; i<ncpus; i++) {
+		result = thread_fork("atomictest", NULL, atomicthread,
+				     NULL, i);
+		if (result) {
+			panic("atomicbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<ncpus; i++) {
+		P(atomic_donesem);
+	}
+	expected = ncpus * NATOMICLOOPS;
+	kprintf("atomic_add: %u (expected %u)\n", addcounter, expected);
+	kprintf("atomic_cas: %u (expected %u)\n", cascounter, expected);
+	if (addcounter != expected || cascounter != expected) {
+		kprintf("Test failed\n");
+	}
+
+	kprintf("Timing %u uncontended round trips...\n", NBENCHLOOPS);
+
+	gettime(&secs, &nsecs);
+	for (i=0; i<NBENCHLOOPS; i++) {
+		P(sem);
+		V(sem);
+	}
+	ns = elapsed(secs, nsecs);
+	kprintf("P/V:                  %llu ns\n", ns / NBENCHLOOPS);
+
+	gettime(&secs, &nsecs);
+	for (i=0; i<NBENCHLOOPS; i++) {
+		lock_acquire(lock);
+		lock_release(lock);
+	}
+	ns = elapsed(secs, nsecs);
+	kprintf("lock_acquire/release: %llu ns\n", ns / NBENCHLOOPS);
+
+	gettime(&secs, &nsecs);
+	for (i=0; i<NBENCHLOOPS; i++) {
+		spinlock_acquire(&spin);
+		spinlock_release(&spin);
+	}
+	ns = elapsed(secs, nsecs);
+	kprintf("spinlock pair:        %llu ns\n", ns / NBENCHLOOPS);
+
+	spinlock_cleanup(&spin);
+	lock_destroy(lock);
+	sem_destroy(sem);
+	sem_destroy(atomic_donesem);
+	kprintf("Atomics test done.\n");
+	return 0;
+}
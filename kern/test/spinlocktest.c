@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Spinlock benchmark: test-and-set versus ticket spinlocks.
+ *
+ * One thread is pinned to each cpu, and they all fight over one
+ * spinlock for a few seconds, holding it briefly and then doing a
+ * little work outside it. We report the total acquisitions (the
+ * throughput) and the spread between the threads that got the lock
+ * most and least often (the fairness). With test-and-set the cpu
+ * that just released the lock tends to win it straight back; with
+ * tickets every waiter gets its turn.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <test.h>
+
+#define MAXBENCHCPUS  32
+#define BENCHSECS     2
+#define HOLDLOOPS     20	/* work done holding the lock */
+#define GAPLOOPS      20	/* work done between acquisitions */
+
+static struct spinlock benchlock;
+static struct semaphore *bench_readysem;
+static struct semaphore *bench_startsem;
+static struct semaphore *bench_donesem;
+static volatile bool bench_stop;
+static volatile unsigned bench_shared;
+static unsigned bench_counts[MAXBENCHCPUS];
+
+static
+void
+benchthread(void *junk, unsigned long num)
+{
+	unsigned count = 0;
+	volatile int j;
+	int result;
+
+	(void)junk;
+
+	result = thread_setaffinity(curthread, 1U << num);
+	if (result) {
+		kprintf("spinlockbench: cpu%lu: %s\n", num, strerror(result));
+	}
+	V(bench_readysem);
+	P(bench_startsem);
+
+	while (!bench_stop) {
+		spinlock_acquire(&benchlock);
+		bench_shared++;
+		for (j=0; j<HOLDLOOPS; j++);
+		spinlock_release(&benchlock);
+		count++;
+		for (j=0; j<GAPLOOPS; j++);
+	}
+
+	bench_counts[num] = count;
+	V(bench_donesem);
+}
+
+static
+void
+runbench(const char *name, bool ticket, unsigned ncpus, int secs)
+{
+	unsigned i, total, min, max;
+	int result;
+
+	if (ticket) {
+		spinlock_init_ticket(&benchlock);
+	}
+	else {
+		spinlock_init(&benchlock);
+	}
+	bench_stop = false;
+	bench_shared = 0;
+
+	for (i=0; i<ncpus; i++) {
+		result = thread_fork("spinlockbench", NULL, benchthread,
+				     NULL, i);
+		if (result) {
+			panic("spinlockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	/* Start everyone at once, once they're all on their cpus */
+	for (i=0; i<ncpus; i++) {
+		P(bench_readysem);
+	}
+	for (i=0; i<ncpus; i++) {
+		V(bench_startsem);
+	}
+	clocksleep(secs);
+	bench_stop = true;
+	for (i=0; i<ncpus; i++) {
+		P(bench_donesem);
+	}
+
+	total = 0;
+	min = max = bench_counts[0];
+	for (i=0; i<ncpus; i++) {
+		total += bench_counts[i];
+		if (bench_counts[i] < min) {
+			min = bench_counts[i];
+		}
+		if (bench_counts[i] > max) {
+			max = bench_counts[i];
+		}
+	}
+	spinlock_cleanup(&benchlock);
+
+	kprintf("%-6s: %u acquisitions (%u/s); per cpu min %u max %u\n",
+		name, total, total / secs, min, max);
+	if (bench_shared != total) {
+		kprintf("%-6s: lost updates (%u, expected %u)\n",
+			name, bench_shared, total);
+		kprintf("Test failed\n");
+	}
+}
+
+int
+spinlockbench(int nargs, char **args)
+{
+	unsigned ncpus;
+	int secs;
+
+	secs = BENCHSECS;
+	if (nargs == 2) {
+		secs = atoi(args[1]);
+	}
+	if (nargs > 2 || secs <= 0) {
+		kprintf("Usage: slb [secs]\n");
+		return EINVAL;
+	}
+
+	ncpus = thread_numcpus();
+	if (ncpus > MAXBENCHCPUS) {
+		ncpus = MAXBENCHCPUS;
+	}
+	if (ncpus < 2) {
+		kprintf("spinlockbench: only one cpu, nothing to contend\n");
+	}
+
+	bench_readysem = sem_create("benchready", 0);
+	bench_startsem = sem_create("benchstart", 0);
+	bench_donesem = sem_create("benchdone", 0);
+	if (bench_readysem == NULL || bench_startsem == NULL ||
+	    bench_donesem == NULL) {
+		panic("spinlockbench: sem_create failed\n");
+	}
+
+	kprintf("Spinlock benchmark: %u cpus, %d seconds per lock type\n",
+		ncpus, secs);
+	runbench("tas", false, ncpus, secs);
+	runbench("ticket", true, ncpus, secs);
+
+	sem_destroy(bench_donesem);
+	sem_destroy(bench_startsem);
+	sem_destroy(bench_readysem);
+	kprintf("Spinlock benchmark done.\n");
+	return 0;
+}
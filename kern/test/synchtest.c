@@ -35,12 +35,14 @@
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <test.h>
 
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NRWLOOPS      200
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -347,3 +349,137 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test. One thread in four is a writer. Writers
+ * check that they are alone and update the test values; readers
+ * check that no writer is inside and that the values are consistent.
+ */
+
+static struct rwlock *testrw;
+static struct spinlock rwtest_spin = SPINLOCK_INITIALIZER;
+static volatile unsigned rwtest_readers;
+static volatile unsigned rwtest_writers;
+static volatile unsigned rwtest_maxreaders;
+static volatile unsigned rwtest_errors;
+
+static
+void
+rwtest_error(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	spinlock_acquire(&rwtest_spin);
+	rwtest_errors++;
+	spinlock_release(&rwtest_spin);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	unsigned n;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % 4 == 0) {
+			rwlock_acquire_write(testrw);
+			spinlock_acquire(&rwtest_spin);
+			if (rwtest_readers != 0 || rwtest_writers != 0) {
+				spinlock_release(&rwtest_spin);
+				rwtest_error(num, "writer not alone");
+				spinlock_acquire(&rwtest_spin);
+			}
+			rwtest_writers++;
+			spinlock_release(&rwtest_spin);
+
+			testval1 = num;
+			for (j=0; j<100; j++);
+			testval2 = num*num;
+			testval3 = num%3;
+
+			spinlock_acquire(&rwtest_spin);
+			rwtest_writers--;
+			spinlock_release(&rwtest_spin);
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			spinlock_acquire(&rwtest_spin);
+			if (rwtest_writers != 0) {
+				spinlock_release(&rwtest_spin);
+				rwtest_error(num, "reader saw a writer");
+				spinlock_acquire(&rwtest_spin);
+			}
+			n = ++rwtest_readers;
+			if (n > rwtest_maxreaders) {
+				rwtest_maxreaders = n;
+			}
+			spinlock_release(&rwtest_spin);
+
+			if (testval2 != testval1*testval1 ||
+			    testval3 != testval1%3) {
+				rwtest_error(num, "inconsistent test values");
+			}
+			for (j=0; j<100; j++);
+
+			spinlock_acquire(&rwtest_spin);
+			rwtest_readers--;
+			spinlock_release(&rwtest_spin);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+int
+rwlocktest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwlocktest: rwlock_create failed\n");
+	}
+	testval1 = testval2 = testval3 = 0;
+	rwtest_readers = rwtest_writers = 0;
+	rwtest_maxreaders = 0;
+	rwtest_errors = 0;
+
+	kprintf("Starting rwlock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwlocktest", NULL, rwtestthread,
+				     NULL, i);
+		if (result) {
+			panic("rwlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	rwlock_destroy(testrw);
+	testrw = NULL;
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("Up to %u readers held the lock at once\n",
+		rwtest_maxreaders);
+	if (rwtest_errors) {
+		kprintf("%u errors\n", rwtest_errors);
+		kprintf("Test failed\n");
+	}
+	kprintf("Rwlock test done.\n");
+
+	return 0;
+}
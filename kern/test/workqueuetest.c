@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Workqueue test.
+ *
+ * Queue a batch of work items from a thread on each cpu and check
+ * that workqueue_flush returns only once every one of them has run.
+ * Then submit some delayed items and report how late each one ran
+ * compared to the delay it asked for.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <atomic.h>
+#include <synch.h>
+#include <workqueue.h>
+#include <test.h>
+
+#define MAXWQCPUS	32
+#define NWQITEMS	64	/* per cpu */
+#define NWQDELAYED	8
+#define WQDELAY_NS	20000000ULL	/* 20 ms per step */
+
+static volatile unsigned wq_counter;
+static struct semaphore *wq_donesem;
+
+static
+void
+wqtest_count(void *data)
+{
+	(void)data;
+	atomic_add(&wq_counter, 1);
+}
+
+static
+void
+wqtest_submitter(void *data, unsigned long num)
+{
+	struct work *items = data;
+	unsigned i;
+
+	/* spread out over the cpus; if this fails we just share one */
+	thread_setaffinity(curthread, 1U << num);
+
+	for (i=0; i<NWQITEMS; i++) {
+		work_init(&items[i], wqtest_count, NULL);
+		workqueue_submit(&items[i]);
+	}
+	V(wq_donesem);
+}
+
+struct wqdelayed {
+	struct work wd_work;
+	uint64_t wd_due;	/* when it asked to run */
+	uint64_t wd_ran;	/* when it did */
+};
+
+static
+void
+wqtest_delayed(void *data)
+{
+	struct wqdelayed *wd = data;
+
+	wd->wd_ran = gettime_nsecs();
+	V(wq_donesem);
+}
+
+int
+workqueuetest(int nargs, char **args)
+{
+	struct work *items;
+	struct wqdelayed delayed[NWQDELAYED];
+	unsigned i, ncpus, expected;
+	uint64_t now;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	ncpus = thread_numcpus();
+	if (ncpus > MAXWQCPUS) {
+		ncpus = MAXWQCPUS;
+	}
+
+	items = kmalloc(ncpus * NWQITEMS * sizeof(*items));
+	wq_donesem = sem_create("wqtest", 0);
+	if (items == NULL || wq_donesem == NULL) {
+		panic("workqueuetest: out of memory\n");
+	}
+
+	kprintf("Starting workqueue test on %u cpus...\n", ncpus);
+	wq_counter = 0;
+	for (i=0; i<ncpus; i++) {
+		result = thread_fork("wqtest", NULL, wqtest_submitter,
+				     &items[i * NWQITEMS], i);
+		if (result) {
+			panic("workqueuetest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<ncpus; i++) {
+		P(wq_donesem);
+	}
+	workqueue_flush();
+	expected = ncpus * NWQITEMS;
+	kprintf("After flush: %u items run (expected %u)\n",
+		wq_counter, expected);
+	if (wq_counter != expected) {
+		kprintf("Test failed\n");
+	}
+	/* Everything has run, so the items are ours again. */
+	kfree(items);
+
+	kprintf("Submitting %u delayed items...\n", NWQDELAYED);
+	now = gettime_nsecs();
+	for (i=0; i<NWQDELAYED; i++) {
+		work_init(&delayed[i].wd_work, wqtest_delayed, &delayed[i]);
+		delayed[i].wd_due = now + (i + 1) * WQDELAY_NS;
+		workqueue_submit_delayed(&delayed[i].wd_work,
+					 (i + 1) * WQDELAY_NS);
+	}
+	for (i=0; i<NWQDELAYED; i++) {
+		P(wq_donesem);
+	}
+	for (i=0; i<NWQDELAYED; i++) {
+		if (delayed[i].wd_ran < delayed[i].wd_due) {
+			kprintf("Item %u ran %llu us early; test failed\n", i,
+				(delayed[i].wd_due - delayed[i].wd_ran) / 1000);
+			continue;
+		}
+		kprintf("Item %u: asked for %llu ms, ran %llu us late\n", i,
+			(i + 1) * WQDELAY_NS / 1000000,
+			(delayed[i].wd_ran - delayed[i].wd_due) / 1000);
+	}
+
+	sem_destroy(wq_donesem);
+	kprintf("Workqueue test done.\n");
+	return 0;
+}
@@ -30,6 +30,7 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
@@ -39,9 +40,10 @@
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Timed sleeps go through a timer wheel (below), which is driven by
+ * a one-shot ltimer programmed for the next thing that's due, so
+ * sleepers are woken once, when their deadline arrives, and nothing
+ * ticks when nothing is waiting.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -52,59 +54,217 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define MIGRATE_HARDCLOCKS	16	/* Rebalance every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Timer wheel.
+ *
+ * Pending timers are hashed by expiry tick into a hierarchy of slot
+ * arrays. Level 0 has one slot per tick for the next TW_SLOTS0
+ * ticks; each slot of level N+1 covers a whole rotation of level N.
+ * Whenever level 0 wraps around, the next slot up is cascaded down
+ * into the levels below it. Adding a timer is constant time, and
+ * each timer is moved at most once per level before it expires.
+ *
+ * tw_now is the next tick to process. When nothing is pending it is
+ * allowed to fall behind, and is caught up by the next timer_add.
  */
-static struct wchan *lbolt;
+#define TIMER_TICK_NS	1000000ULL	/* wheel resolution: 1 ms */
+#define TW_BITS0	8
+#define TW_BITS		6
+#define TW_SLOTS0	(1 << TW_BITS0)
+#define TW_SLOTS	(1 << TW_BITS)
+#define TW_UPPER	3		/* levels above level 0 */
+
+static struct spinlock timer_lock = SPINLOCK_INITIALIZER;
+static struct timer *tw_level0[TW_SLOTS0];
+static struct timer *tw_upper[TW_UPPER][TW_SLOTS];
+static uint64_t tw_now;		/* next tick to process */
+static unsigned tw_count;	/* timers pending */
+static uint64_t tw_armed;	/* tick the ltimer is set for, or 0 */
+
 /*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
+ * Threads in thread_sleep_until sleep here, and are woken individually.
  */
-static struct wchan *minibolt;
+static struct wchan *sleepchan;
 
-/* 
- * number of minibolts per second
+/*
+ * Setup.
  */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+void
+hardclock_bootstrap(void)
+{
+	sleepchan = wchan_create("sleep");
+	if (sleepchan == NULL) {
+		panic("Couldn't create sleepchan\n");
+	}
+}
+
+/*
+ * Put TM in the slot for its expiry tick. Timers beyond the top
+ * level's reach go in the farthest slot and are cascaded back up
+ * until they come into range. Call with timer_lock held.
+ */
+static
+void
+timer_enqueue(struct timer *tm)
+{
+	struct timer **slot;
+	uint64_t tick, delta;
+	unsigned level, shift;
+
+	tick = tm->tm_tick < tw_now ? tw_now : tm->tm_tick;
+	delta = tick - tw_now;
+	if (delta < TW_SLOTS0) {
+		slot = &tw_level0[tick & (TW_SLOTS0 - 1)];
+	}
+	else {
+		shift = TW_BITS0;
+		for (level = 0; level < TW_UPPER - 1; level++) {
+			if (delta < (1ULL << (shift + TW_BITS))) {
+				break;
+			}
+			shift += TW_BITS;
+		}
+		if (delta >= (1ULL << (shift + TW_BITS))) {
+			tick = tw_now + (1ULL << (shift + TW_BITS)) - 1;
+		}
+		slot = &tw_upper[level][(tick >> shift) & (TW_SLOTS - 1)];
+	}
+	tm->tm_next = *slot;
+	*slot = tm;
+}
 
 /*
- * minibolt countdown
+ * Process ticks up to and including NOWTICK: cascade upper levels as
+ * level 0 wraps, and return the timers that expired as a list.
+ * Call with timer_lock held.
  */
-static int minicount;
+static
+struct timer *
+timer_advance(uint64_t nowtick)
+{
+	struct timer *expired, *tm, *next;
+	unsigned index, level, shift, upindex;
+
+	expired = NULL;
+	while (tw_now <= nowtick) {
+		index = tw_now & (TW_SLOTS0 - 1);
+		if (index == 0) {
+			shift = TW_BITS0;
+			for (level = 0; level < TW_UPPER; level++) {
+				upindex = (tw_now >> shift) & (TW_SLOTS - 1);
+				tm = tw_upper[level][upindex];
+				tw_upper[level][upindex] = NULL;
+				for (; tm != NULL; tm = next) {
+					next = tm->tm_next;
+					timer_enqueue(tm);
+				}
+				if (upindex != 0) {
+					break;
+				}
+				shift += TW_BITS;
+			}
+		}
+		while ((tm = tw_level0[index]) != NULL) {
+			tw_level0[index] = tm->tm_next;
+			tm->tm_next = expired;
+			expired = tm;
+			tw_count--;
+		}
+		tw_now++;
+	}
+	return expired;
+}
 
 /*
- * Setup.
+ * Return the tick the ltimer should next go off at: the next full
+ * slot in the rest of level 0's rotation, or the end of the rotation
+ * so the levels above can be cascaded. Call with timer_lock held and
+ * something pending.
+ */
+static
+uint64_t
+timer_nexttick(void)
+{
+	unsigned index, i;
+
+	index = tw_now & (TW_SLOTS0 - 1);
+	for (i = index; i < TW_SLOTS0; i++) {
+		if (tw_level0[i] != NULL) {
+			return tw_now + (i - index);
+		}
+	}
+	return tw_now + (TW_SLOTS0 - index);
+}
+
+/*
+ * Program the ltimer to go off at TICK, given the time is NOW.
+ * Call with timer_lock held.
  */
+static
 void
-hardclock_bootstrap(void)
+timer_arm(uint64_t tick, uint64_t now)
+{
+	uint64_t when;
+	uint32_t usecs;
+
+	when = tick * TIMER_TICK_NS;
+	usecs = when > now ? (when - now + 999) / 1000 : 1;
+	tw_armed = tick;
+	ltimer_settimer(usecs);
+}
+
+void
+timer_add(struct timer *tm, uint64_t when,
+	  void (*func)(void *), void *data)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	uint64_t now;
+
+	tm->tm_tick = (when + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+	tm->tm_func = func;
+	tm->tm_data = data;
+
+	spinlock_acquire(&timer_lock);
+	now = gettime_nsecs();
+	if (tw_count == 0) {
+		tw_now = now / TIMER_TICK_NS;
 	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+	timer_enqueue(tm);
+	tw_count++;
+	if (tw_armed == 0 || tm->tm_tick < tw_armed) {
+		timer_arm(tm->tm_tick, now);
 	}
-	minicount = MINI_PER_SECOND;
-	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
+	spinlock_release(&timer_lock);
 }
 
 /*
- * This is called once every every LT_GRANULARITY usec, on one processor,
- * by the timer code.
+ * This is called on one processor, by the timer code, each time the
+ * one-shot timer set by timer_arm goes off.
  */
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
+	struct timer *expired, *tm, *next;
+	uint64_t now;
+
+	spinlock_acquire(&timer_lock);
+	tw_armed = 0;
+	if (tw_count == 0) {
+		spinlock_release(&timer_lock);
+		return;
+	}
+	now = gettime_nsecs();
+	expired = timer_advance(now / TIMER_TICK_NS);
+	if (tw_count > 0) {
+		timer_arm(timer_nexttick(), now);
+	}
+	spinlock_release(&timer_lock);
+
+	/* TM may be gone as soon as its function has been called. */
+	for (tm = expired; tm != NULL; tm = next) {
+		next = tm->tm_next;
+		tm->tm_func(tm->tm_data);
 	}
 }
 
@@ -126,7 +286,34 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	thread_timeslice();
+}
+
+/*
+ * Timer function for thread_sleep_until.
+ */
+static
+void
+sleep_expired(void *data)
+{
+	wchan_wakethread(sleepchan, data);
+}
+
+/*
+ * Sleep until DEADLINE. The timer can't go off until we're asleep on
+ * sleepchan, because its function needs the channel lock we hold.
+ */
+void
+thread_sleep_until(uint64_t deadline)
+{
+	struct timer tm;
+
+	if (deadline <= gettime_nsecs()) {
+		return;
+	}
+	wchan_lock(sleepchan);
+	timer_add(&tm, deadline, sleep_expired, curthread);
+	wchan_sleep(sleepchan);
 }
 
 /*
@@ -135,11 +322,10 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	if (num_secs > 0) {
+		thread_sleep_until(gettime_nsecs() +
+				   (uint64_t)num_secs * 1000000000ULL);
+	}
 }
 
 /*
@@ -149,9 +335,8 @@ clocksleep(int num_secs)
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	if (num_ticks > 0) {
+		thread_sleep_until(gettime_nsecs() +
+				   (uint64_t)num_ticks * LT_GRANULARITY * 1000);
+	}
 }
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock contention profiler. See lockprof.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <lockprof.h>
+
+/*
+ * Classes live in a fixed table so that they can be created before
+ * kmalloc works and from under spinlocks (including kmalloc's own).
+ * Once the table is full, further names are all charged to the last
+ * entry, "(other)".
+ */
+#define LOCKPROF_MAXCLASSES	64
+#define LOCKPROF_NAMELEN	24
+
+struct lockclass {
+	char lc_name[LOCKPROF_NAMELEN];
+	unsigned lc_kind;
+
+	/* statistics; updated under lc_spin */
+	struct spinlock lc_spin;
+	unsigned lc_nacquire;
+	unsigned lc_ncontended;
+	uint64_t lc_waitns;
+	uint64_t lc_maxwaitns;
+	uint64_t lc_holdns;
+	uint64_t lc_maxholdns;
+};
+
+static struct lockclass lockclasses[LOCKPROF_MAXCLASSES];
+static unsigned lockclass_count;
+static struct spinlock lockclass_lock = SPINLOCK_INITIALIZER;
+static volatile bool lockprof_running;
+
+static const char *const lockprof_kinds[] = { "lock", "cv", "spin" };
+
+/*
+ * Copy NAME into a class, truncating it to fit; and compare a name
+ * against a class's (possibly truncated) copy.
+ */
+static
+void
+lockprof_setname(struct lockclass *lc, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKPROF_NAMELEN-1 && name[i] != 0; i++) {
+		lc->lc_name[i] = name[i];
+	}
+	lc->lc_name[i] = 0;
+}
+
+static
+bool
+lockprof_samename(struct lockclass *lc, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKPROF_NAMELEN-1; i++) {
+		if (lc->lc_name[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			return true;
+		}
+	}
+	return true;
+}
+
+struct lockclass *
+lockprof_class(const char *name, unsigned kind)
+{
+	struct lockclass *lc;
+	unsigned i;
+
+	KASSERT(kind <= LOCKPROF_SPIN);
+
+	spinlock_acquire(&lockclass_lock);
+	for (i=0; i<lockclass_count; i++) {
+		lc = &lockclasses[i];
+		if (lc->lc_kind == kind &&
+		    lockprof_samename(lc, name)) {
+			spinlock_release(&lockclass_lock);
+			return lc;
+		}
+	}
+	if (lockclass_count == LOCKPROF_MAXCLASSES) {
+		/* table full */
+		lc = &lockclasses[LOCKPROF_MAXCLASSES - 1];
+		spinlock_release(&lockclass_lock);
+		return lc;
+	}
+
+	lc = &lockclasses[lockclass_count];
+	if (lockclass_count == LOCKPROF_MAXCLASSES - 1) {
+		name = "(other)";
+	}
+	lockprof_setname(lc, name);
+	lc->lc_kind = kind;
+	spinlock_init(&lc->lc_spin);
+	lockclass_count++;
+	spinlock_release(&lockclass_lock);
+	return lc;
+}
+
+uint64_t
+lockprof_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!lockprof_running) {
+		return 0;
+	}
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000ULL + nsecs;
+}
+
+uint64_t
+lockprof_acquired(struct lockclass *lc, bool contended, uint64_t waitstart)
+{
+	uint64_t now, wait;
+
+	now = lockprof_now();
+	if (now == 0) {
+		return 0;
+	}
+
+	spinlock_acquire(&lc->lc_spin);
+	lc->lc_nacquire++;
+	/* waitstart is 0 if the wait began before we were running */
+	if (contended && waitstart != 0) {
+		lc->lc_ncontended++;
+		wait = now - waitstart;
+		lc->lc_waitns += wait;
+		if (wait > lc->lc_maxwaitns) {
+			lc->lc_maxwaitns = wait;
+		}
+	}
+	spinlock_release(&lc->lc_spin);
+	return now;
+}
+
+void
+lockprof_released(struct lockclass *lc, uint64_t acqtime)
+{
+	uint64_t now, hold;
+
+	if (acqtime == 0) {
+		return;
+	}
+	now = lockprof_now();
+
+	hold = now - acqtime;
+	spinlock_acquire(&lc->lc_spin);
+	lc->lc_holdns += hold;
+	if (hold > lc->lc_maxholdns) {
+		lc->lc_maxholdns = hold;
+	}
+	spinlock_release(&lc->lc_spin);
+}
+
+/*
+ * Start timing. Called from boot() once the clock is attached.
+ */
+void
+lockprof_bootstrap(void)
+{
+	lockprof_running = true;
+}
+
+void
+lockprof_reset(void)
+{
+	struct lockclass *lc;
+	unsigned i, num;
+
+	spinlock_acquire(&lockclass_lock);
+	num = lockclass_count;
+	spinlock_release(&lockclass_lock);
+
+	for (i=0; i<num; i++) {
+		lc = &lockclasses[i];
+		spinlock_acquire(&lc->lc_spin);
+		lc->lc_nacquire = 0;
+		lc->lc_ncontended = 0;
+		lc->lc_waitns = 0;
+		lc->lc_maxwaitns = 0;
+		lc->lc_holdns = 0;
+		lc->lc_maxholdns = 0;
+		spinlock_release(&lc->lc_spin);
+	}
+}
+
+/*
+ * Print the classes that have been used, most total wait time first.
+ * The numbers are read without the class locks, so a line may be
+ * slightly inconsistent if the lock is busy while we print.
+ */
+void
+lockprof_printstats(void)
+{
+	uint8_t order[LOCKPROF_MAXCLASSES];
+	struct lockclass *lc;
+	unsigned i, j, num;
+	uint8_t tmp;
+
+	spinlock_acquire(&lockclass_lock);
+	num = lockclass_count;
+	spinlock_release(&lockclass_lock);
+
+	for (i=0; i<num; i++) {
+		order[i] = i;
+	}
+	/* insertion sort; there are at most a few dozen classes */
+	for (i=1; i<num; i++) {
+		for (j=i; j>0; j--) {
+			if (lockclasses[order[j-1]].lc_waitns >=
+			    lockclasses[order[j]].lc_waitns) {
+				break;
+			}
+			tmp = order[j-1];
+			order[j-1] = order[j];
+			order[j] = tmp;
+		}
+	}
+
+	kprintf("%-23s %-4s %8s %8s %10s %8s %10s %8s\n",
+		"name", "kind", "acq", "contend",
+		"wait(us)", "max", "hold(us)", "max");
+	for (i=0; i<num; i++) {
+		lc = &lockclasses[order[i]];
+		if (lc->lc_nacquire == 0) {
+			continue;
+		}
+		kprintf("%-23s %-4s %8u %8u %10llu %8llu %10llu %8llu\n",
+			lc->lc_name, lockprof_kinds[lc->lc_kind],
+			lc->lc_nacquire, lc->lc_ncontended,
+			lc->lc_waitns / 1000, lc->lc_maxwaitns / 1000,
+			lc->lc_holdns / 1000, lc->lc_maxholdns / 1000);
+	}
+}
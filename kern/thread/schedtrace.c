@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Scheduler trace ring. See schedtrace.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <atomic.h>
+#include <thread.h>
+#include <schedtrace.h>
+
+struct schedevent {
+	uint64_t se_time;		/* when, in ns (0 before timing) */
+	uint64_t se_waited;		/* how long se_in waited to run */
+	unsigned se_cpu;
+	unsigned se_state;		/* what se_out did */
+	char se_out[THREAD_NAMELEN];
+	char se_in[THREAD_NAMELEN];
+};
+
+/*
+ * Writers claim slots with atomic_add and don't lock, so a dump taken
+ * while switches are happening may show an entry being overwritten.
+ * Dump after the run you care about.
+ */
+static struct schedevent schedevents[SCHEDTRACE_NEVENTS];
+static volatile unsigned schedevent_next;
+
+static const char *const schedtrace_states[] = {
+	"run", "yield", "sleep", "exit",
+};
+
+void
+schedtrace_record(unsigned cpunum, struct thread *out, unsigned state,
+		  struct thread *in, uint64_t now, uint64_t waited)
+{
+	struct schedevent *se;
+	unsigned n;
+
+	n = atomic_add(&schedevent_next, 1) - 1;
+	se = &schedevents[n & (SCHEDTRACE_NEVENTS - 1)];
+	se->se_time = now;
+	se->se_waited = waited;
+	se->se_cpu = cpunum;
+	se->se_state = state;
+	snprintf(se->se_out, sizeof(se->se_out), "%s", out->t_name);
+	snprintf(se->se_in, sizeof(se->se_in), "%s", in->t_name);
+}
+
+/*
+ * Print the ring, oldest first, with times relative to the oldest.
+ */
+void
+schedtrace_dump(void)
+{
+	struct schedevent *se;
+	unsigned next, first, i;
+	uint64_t base;
+
+	next = schedevent_next;
+	first = next > SCHEDTRACE_NEVENTS ? next - SCHEDTRACE_NEVENTS : 0;
+	if (first == next) {
+		kprintf("No switches recorded\n");
+		return;
+	}
+	base = schedevents[first & (SCHEDTRACE_NEVENTS - 1)].se_time;
+
+	kprintf("%10s %3s %-16s %-5s %-16s %10s\n",
+		"time(us)", "cpu", "out", "did", "in", "waited(us)");
+	for (i=first; i != next; i++) {
+		se = &schedevents[i & (SCHEDTRACE_NEVENTS - 1)];
+		kprintf("%10llu %3u %-16s %-5s %-16s %10llu\n",
+			se->se_time >= base ? (se->se_time - base) / 1000 : 0,
+			se->se_cpu, se->se_out,
+			schedtrace_states[se->se_state], se->se_in,
+			se->se_waited / 1000);
+	}
+}
+
+void
+schedtrace_reset(void)
+{
+	schedevent_next = 0;
+}
@@ -36,6 +36,7 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#include <lockprof.h>
 
 /*
  * Spinlocks.
@@ -50,6 +51,22 @@ spinlock_init(struct spinlock *lk)
 {
 	spinlock_data_set(&lk->lk_lock, 0);
 	lk->lk_holder = NULL;
+	spinlock_data_set(&lk->lk_next, 0);
+	lk->lk_ticket = false;
+#if OPT_LOCKPROF
+	lk->lk_prof = NULL;
+	lk->lk_acqtime = 0;
+#endif
+}
+
+/*
+ * Initialize a ticket spinlock.
+ */
+void
+spinlock_init_ticket(struct spinlock *lk)
+{
+	spinlock_init(lk);
+	lk->lk_ticket = true;
 }
 
 /*
@@ -59,7 +76,14 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	if (lk->lk_ticket) {
+		/* everyone who took a ticket has been served */
+		KASSERT(spinlock_data_get(&lk->lk_lock) ==
+			spinlock_data_get(&lk->lk_next));
+	}
+	else {
+		KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	}
 }
 
 /*
@@ -73,6 +97,11 @@ void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+#if OPT_LOCKPROF
+	bool contended = false;
+	uint64_t waitstart = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +116,56 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
+	if (lk->lk_ticket) {
 		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
+		 * Take a ticket and wait for it to come up. Only the
+		 * holder writes lk_lock, so waiters spin reading.
 		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
+		ticket = spinlock_data_fetchadd(&lk->lk_next, 1);
+		while (spinlock_data_get(&lk->lk_lock) != ticket) {
+#if OPT_LOCKPROF
+			if (!contended && lk->lk_prof != NULL) {
+				contended = true;
+				waitstart = lockprof_now();
+			}
+#endif
 		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
+	}
+	else {
+		while (1) {
+			/*
+			 * Do test-test-and-set, that is, read first before
+			 * doing test-and-set, to reduce bus contention.
+			 *
+			 * Test-and-set is a machine-level atomic operation
+			 * that writes 1 into the lock word and returns the
+			 * previous value. If that value was 0, the lock was
+			 * previously unheld and we now own it. If it was 1,
+			 * we don't.
+			 */
+			if (spinlock_data_get(&lk->lk_lock) != 0) {
+#if OPT_LOCKPROF
+				if (!contended && lk->lk_prof != NULL) {
+					contended = true;
+					waitstart = lockprof_now();
+				}
+#endif
+				continue;
+			}
+			if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+				continue;
+			}
+			break;
 		}
-		break;
 	}
 
 	lk->lk_holder = mycpu;
+#if OPT_LOCKPROF
+	if (lk->lk_prof != NULL) {
+		lk->lk_acqtime = lockprof_acquired(lk->lk_prof, contended,
+						   waitstart);
+	}
+#endif
 }
 
 /*
@@ -121,8 +179,20 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKPROF
+	if (lk->lk_prof != NULL) {
+		lockprof_released(lk->lk_prof, lk->lk_acqtime);
+	}
+#endif
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	if (lk->lk_ticket) {
+		/* serve the next ticket */
+		spinlock_data_set(&lk->lk_lock,
+				  spinlock_data_get(&lk->lk_lock) + 1);
+	}
+	else {
+		spinlock_data_set(&lk->lk_lock, 0);
+	}
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -139,3 +209,14 @@ spinlock_do_i_hold(struct spinlock *lk)
 	/* Assume we can read lk_holder atomically enough for this to work */
 	return (lk->lk_holder == curcpu->c_self);
 }
+
+#if OPT_LOCKPROF
+/*
+ * Charge a spinlock to the profiling class NAME.
+ */
+void
+spinlock_profile(struct spinlock *lk, const char *name)
+{
+	lk->lk_prof = lockprof_class(name, LOCKPROF_SPIN);
+}
+#endif
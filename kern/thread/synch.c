@@ -35,10 +35,13 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <atomic.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
+#include <lockprof.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -71,6 +74,7 @@ sem_create(const char *name, int initial_count)
 
 	spinlock_init(&sem->sem_lock);
         sem->sem_count = initial_count;
+        sem->sem_waiters = 0;
 
         return sem;
 }
@@ -87,6 +91,26 @@ sem_destroy(struct semaphore *sem)
         kfree(sem);
 }
 
+/*
+ * Try to take one from the count without blocking. Returns false if
+ * the count is zero.
+ */
+static
+bool
+sem_tryP(struct semaphore *sem)
+{
+	unsigned count;
+
+	while ((count = sem->sem_count) > 0) {
+		if (atomic_cas(&sem->sem_count, count, count - 1)) {
+			/* acquire: see V */
+			membar();
+			return true;
+		}
+	}
+	return false;
+}
+
 void 
 P(struct semaphore *sem)
 {
@@ -100,8 +124,21 @@ P(struct semaphore *sem)
          */
         KASSERT(curthread->t_in_interrupt == false);
 
+	/* Fast path: count is positive. */
+	if (sem_tryP(sem)) {
+		return;
+	}
+
+	/*
+	 * Slow path. Announce ourselves in sem_waiters before looking
+	 * at the count again; V bumps the count before looking at
+	 * sem_waiters. With the barriers, either we see V's count or
+	 * V sees us and comes through sem_lock to wake us up.
+	 */
 	spinlock_acquire(&sem->sem_lock);
-        while (sem->sem_count == 0) {
+	sem->sem_waiters++;
+	membar();
+        while (!sem_tryP(sem)) {
 		/*
 		 * Bridge to the wchan lock, so if someone else comes
 		 * along in V right this instant the wakeup can't go
@@ -124,8 +161,7 @@ P(struct semaphore *sem)
 
 		spinlock_acquire(&sem->sem_lock);
         }
-        KASSERT(sem->sem_count > 0);
-        sem->sem_count--;
+	sem->sem_waiters--;
 	spinlock_release(&sem->sem_lock);
 }
 
@@ -134,12 +170,25 @@ V(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	spinlock_acquire(&sem->sem_lock);
+	/*
+	 * The atomics don't order other memory, so a semaphore used
+	 * as a mutex needs barriers of its own: this one publishes
+	 * our stores before the count goes up, and the one in sem_tryP
+	 * keeps the P side from reading ahead of taking the count.
+	 * The one after the add orders it against the sem_waiters read.
+	 */
+	membar();
+        if (atomic_add(&sem->sem_count, 1) == 0) {
+                panic("V: semaphore %s count overflowed\n", sem->sem_name);
+        }
+	membar();
+	if (sem->sem_waiters == 0) {
+		/* Fast path: nobody to wake. */
+		return;
+	}
 
-        sem->sem_count++;
-        KASSERT(sem->sem_count > 0);
+	spinlock_acquire(&sem->sem_lock);
 	wchan_wakeone(sem->sem_wchan);
-
 	spinlock_release(&sem->sem_lock);
 }
 
@@ -147,6 +196,78 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * System-wide lock contention counters. Only the contended paths
+ * touch these, so the uncontended acquire stays cheap.
+ */
+static struct spinlock lockstats_spin = SPINLOCK_INITIALIZER;
+static unsigned lockstats_spinok;	/* spun, then got the lock */
+static unsigned lockstats_spinfail;	/* spun, then had to sleep */
+static unsigned lockstats_sleep;	/* slept without spinning */
+static unsigned lockstats_morphed;	/* CV waiters moved to the lock */
+
+/*
+ * Return true if the lock's owner is currently executing on some
+ * other cpu, in which case it is likely to release the lock soon and
+ * spinning is cheaper than a context switch. On a single cpu the
+ * owner can never be running while we are, so we always sleep.
+ *
+ * Call with lock_spin held: then the owner can't release the lock,
+ * and so can't exit and be freed, while we look at it. (Its cpu's
+ * run queue lock isn't held, so the answer is still only a hint.)
+ */
+static
+bool
+lock_owner_running(struct lock *lock)
+{
+	struct thread *owner;
+	struct cpu *c;
+
+	KASSERT(spinlock_do_i_hold(&lock->lock_spin));
+
+	owner = (struct thread *)lock->lock_owner;
+	if (owner == NULL) {
+		return false;
+	}
+	c = owner->t_cpu;
+	return owner->t_state == S_RUN && c != curcpu->c_self &&
+		c->c_curthread == owner;
+}
+
+/* How often lock_spin_wait checks that the owner is still running. */
+#define LOCK_SPIN_CHECK	100
+
+/*
+ * Spin, without holding lock_spin, while the lock is held by a thread
+ * that is running elsewhere. Returns true if the lock was seen free,
+ * false if we gave up because the owner stopped running or the spin
+ * bound ran out. Only lock_held is read while spinning; the owner
+ * may be gone by then, so it is looked at (under lock_spin) just
+ * every LOCK_SPIN_CHECK iterations.
+ */
+static
+bool
+lock_spin_wait(struct lock *lock)
+{
+	unsigned i;
+	bool running;
+
+	for (i = 1; i <= LOCK_SPIN_MAX; i++) {
+		if (!lock->lock_held) {
+			return true;
+		}
+		if (i % LOCK_SPIN_CHECK == 0) {
+			spinlock_acquire(&lock->lock_spin);
+			running = !lock->lock_held || lock_owner_running(lock);
+			spinlock_release(&lock->lock_spin);
+			if (!running) {
+				return false;
+			}
+		}
+	}
+	return false;
+}
+
 struct lock *
 lock_create(const char *name)
 {
@@ -174,6 +295,15 @@ lock_create(const char *name)
         spinlock_init(&lock->lock_spin);
         lock->lock_owner = NULL;
         lock->lock_held = false;
+        lock->lock_nacquire = 0;
+        lock->lock_nspin = 0;
+        lock->lock_nsleep = 0;
+        lock->lock_prio = SCHED_NLEVELS;
+        lock->lock_next = NULL;
+#if OPT_LOCKPROF
+        lock->lock_prof = lockprof_class(name, LOCKPROF_LOCK);
+        lock->lock_acqtime = 0;
+#endif
         
         return lock;
 }
@@ -203,8 +333,42 @@ lock_acquire(struct lock *lock)
         KASSERT(lock != NULL);
         KASSERT(lock_do_i_hold(lock) == false);
 
+        bool spun = false, slept = false;
+#if OPT_LOCKPROF
+        uint64_t waitstart = 0;
+        bool contended = false;
+#endif
+
     spinlock_acquire(&lock->lock_spin);
         while (lock->lock_held) {
+#if OPT_LOCKPROF
+            if (!contended) {
+                contended = true;
+                waitstart = lockprof_now();
+            }
+#endif
+            // If the owner is running on another cpu it will probably
+            // let go soon; spin instead of paying for a context switch.
+            if (!slept && lock_owner_running(lock)) {
+                spun = true;
+        spinlock_release(&lock->lock_spin);
+                if (lock_spin_wait(lock)) {
+        spinlock_acquire(&lock->lock_spin);
+                    // Somebody else may have beaten us to it.
+                    continue;
+                }
+        spinlock_acquire(&lock->lock_spin);
+                if (!lock->lock_held) {
+                    continue;
+                }
+            }
+            slept = true;
+            // Lend our level to the owner so it can't be starved
+            // by threads less important than us while we wait.
+            if (thread_level(curthread) < lock->lock_prio) {
+                lock->lock_prio = thread_level(curthread);
+            }
+            thread_inherit((struct thread *)lock->lock_owner, lock->lock_prio);
             // Must lock the wait channel inside the spinlock. Avoid the thread holding the lock
             // release the lock between wchan_lock and wchan_sleep. Can potentially cause the 
             // thread sleeping forever.
@@ -218,7 +382,39 @@ lock_acquire(struct lock *lock)
         }
         lock->lock_held = true;
         lock->lock_owner = curthread;
+        lock->lock_next = curthread->t_locks;
+        curthread->t_locks = lock;
+        if (lock->lock_prio < SCHED_NLEVELS) {
+            // others are still waiting; carry their level
+            thread_inherit(curthread, lock->lock_prio);
+        }
+        lock->lock_nacquire++;
+        if (spun && !slept) {
+            lock->lock_nspin++;
+        }
+        if (slept) {
+            lock->lock_nsleep++;
+        }
     spinlock_release(&lock->lock_spin);
+
+#if OPT_LOCKPROF
+        lock->lock_acqtime = lockprof_acquired(lock->lock_prof, contended,
+                                               waitstart);
+#endif
+
+        if (spun || slept) {
+            spinlock_acquire(&lockstats_spin);
+            if (!slept) {
+                lockstats_spinok++;
+            }
+            else if (spun) {
+                lockstats_spinfail++;
+            }
+            else {
+                lockstats_sleep++;
+            }
+            spinlock_release(&lockstats_spin);
+        }
 }
 
 void
@@ -228,14 +424,33 @@ lock_release(struct lock *lock)
         // Must own the lock
         KASSERT(lock_do_i_hold(lock));
 
+#if OPT_LOCKPROF
+        lockprof_released(lock->lock_prof, lock->lock_acqtime);
+#endif
+        struct lock **lp;
+
     spinlock_acquire(&lock->lock_spin);
 
         lock->lock_held = false;
         lock->lock_owner = NULL;
+        // Take it off our list of held locks; usually it's the last
+        // one we acquired.
+        for (lp = &curthread->t_locks; *lp != lock; lp = &(*lp)->lock_next) {
+            KASSERT(*lp != NULL);
+        }
+        *lp = lock->lock_next;
+        lock->lock_next = NULL;
         wchan_wakeone(lock->lock_wchan);
+        // Whoever gets the lock next owes only the threads still
+        // asleep on it, not us or the one we just woke.
+        lock->lock_prio = wchan_toplevel(lock->lock_wchan);
 
     spinlock_release(&lock->lock_spin);
 
+        // Give back whatever level was lent to us through this lock.
+        if (curthread->t_boost < SCHED_NLEVELS) {
+            thread_disinherit();
+        }
 }
 
 bool
@@ -245,6 +460,25 @@ lock_do_i_hold(struct lock *lock)
         return lock->lock_owner == curthread;
 }
 
+void
+lock_printstats(void)
+{
+	unsigned spinok, spinfail, sleep, morphed;
+
+	spinlock_acquire(&lockstats_spin);
+	spinok = lockstats_spinok;
+	spinfail = lockstats_spinfail;
+	sleep = lockstats_sleep;
+	morphed = lockstats_morphed;
+	spinlock_release(&lockstats_spin);
+
+	kprintf("Contended lock acquisitions:\n");
+	kprintf("  %u acquired by spinning\n", spinok);
+	kprintf("  %u spun, then slept\n", spinfail);
+	kprintf("  %u slept (owner not running)\n", sleep);
+	kprintf("CV waiters moved onto their lock: %u\n", morphed);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -273,6 +507,9 @@ cv_create(const char *name)
             kfree(cv);
             return NULL;
         }
+#if OPT_LOCKPROF
+        cv->cv_prof = lockprof_class(name, LOCKPROF_CV);
+#endif
         
         return cv;
 }
@@ -293,23 +530,238 @@ cv_wait(struct cv *cv, struct lock *lock)
 {
         // Make sure curthread is in the critical section (own the lock)
         KASSERT(lock_do_i_hold(lock));
+#if OPT_LOCKPROF
+        uint64_t waitstart = lockprof_now();
+#endif
         
         wchan_lock(cv->cv_wchan);   // Lock the wait channel
         lock_release(lock);         // Release the lock, and other thread may enter
         wchan_sleep(cv->cv_wchan);  // Block the thread, waiting on the condition
+#if OPT_LOCKPROF
+        lockprof_acquired(cv->cv_prof, true, waitstart);
+#endif
         lock_acquire(lock);         // Reacquire the lock, ahter cv_signal/cv_broadcast
 }
 
+/*
+ * Wait morphing. A thread woken from cv_wait goes straight into
+ * lock_acquire, and if the signaller still holds the lock (the usual
+ * case) it just goes back to sleep, on lock_wchan this time. So when
+ * the caller holds the lock, skip the round trip: move the waiters
+ * from the CV's wait channel to the lock's, and lock_release will
+ * wake them one at a time. A broadcast then costs one context switch
+ * per waiter as it actually gets the lock, instead of a stampede.
+ *
+ * Threads only ever move from a CV to its lock, never the other way,
+ * as wchan_transfer requires.
+ *
+ * If the caller doesn't hold the lock we can't tell when it will be
+ * released, so wake the waiters up as before.
+ */
+static
+void
+cv_morph(struct cv *cv, struct lock *lock, bool all)
+{
+    unsigned n, level;
+
+    n = wchan_transfer(cv->cv_wchan, lock->lock_wchan, all);
+    if (n > 0) {
+        // The moved threads are now waiting for the lock, so lend
+        // their levels to its owner (us) as lock_acquire would.
+        spinlock_acquire(&lock->lock_spin);
+        level = wchan_toplevel(lock->lock_wchan);
+        if (level < lock->lock_prio) {
+            lock->lock_prio = level;
+        }
+        thread_inherit(curthread, lock->lock_prio);
+        spinlock_release(&lock->lock_spin);
+
+        spinlock_acquire(&lockstats_spin);
+        lockstats_morphed += n;
+        spinlock_release(&lockstats_spin);
+    }
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-    (void)lock;
-    wchan_wakeone(cv->cv_wchan);
+    if (lock_do_i_hold(lock)) {
+        cv_morph(cv, lock, false);
+    }
+    else {
+        wchan_wakeone(cv->cv_wchan);
+    }
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-    (void)lock;
-    wchan_wakeall(cv->cv_wchan);
+    if (lock_do_i_hold(lock)) {
+        cv_morph(cv, lock, true);
+    }
+    else {
+        wchan_wakeall(cv->cv_wchan);
+    }
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_rwchan = wchan_create(rw->rw_name);
+	if (rw->rw_rwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_wwchan = wchan_create(rw->rw_name);
+	if (rw->rw_wwchan == NULL) {
+		wchan_destroy(rw->rw_rwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_spin);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 0;
+	rw->rw_rwait = 0;
+	rw->rw_wwait = 0;
+	rw->rw_wstreak = 0;
+	rw->rw_rgrant = 0;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_readers == 0);
+
+	/* wchan_destroy will assert if anyone's waiting */
+	spinlock_cleanup(&rw->rw_spin);
+	wchan_destroy(rw->rw_wwchan);
+	wchan_destroy(rw->rw_rwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_spin);
+	/*
+	 * Queue behind any waiting writer, unless readers have been
+	 * granted a turn because writers have gone first too often.
+	 */
+	while (rw->rw_writer != NULL ||
+	       (rw->rw_wwait > 0 && rw->rw_rgrant == 0)) {
+		rw->rw_rwait++;
+		wchan_lock(rw->rw_rwchan);
+		spinlock_release(&rw->rw_spin);
+		wchan_sleep(rw->rw_rwchan);
+		spinlock_acquire(&rw->rw_spin);
+		rw->rw_rwait--;
+	}
+	if (rw->rw_rgrant > 0) {
+		rw->rw_rgrant--;
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_spin);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_spin);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_wwait > 0) {
+		wchan_wakeone(rw->rw_wwchan);
+	}
+	spinlock_release(&rw->rw_spin);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_spin);
+	/* Readers that were granted a turn get in before we do. */
+	while (rw->rw_writer != NULL || rw->rw_readers > 0 ||
+	       rw->rw_rgrant > 0) {
+		rw->rw_wwait++;
+		wchan_lock(rw->rw_wwchan);
+		spinlock_release(&rw->rw_spin);
+		wchan_sleep(rw->rw_wwchan);
+		spinlock_acquire(&rw->rw_spin);
+		rw->rw_wwait--;
+	}
+	rw->rw_writer = curthread;
+	if (rw->rw_rwait > 0) {
+		rw->rw_wstreak++;
+	}
+	spinlock_release(&rw->rw_spin);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rwlock_do_i_write(rw));
+
+	spinlock_acquire(&rw->rw_spin);
+	rw->rw_writer = NULL;
+	if (rw->rw_rwait > 0 &&
+	    (rw->rw_wwait == 0 || rw->rw_wstreak >= RWLOCK_MAXWRITERS)) {
+		/*
+		 * Let in the readers that are waiting now. If writers
+		 * are waiting too, this is a bounded batch: readers
+		 * arriving after this point queue behind the writers.
+		 */
+		if (rw->rw_wwait > 0) {
+			rw->rw_rgrant = rw->rw_rwait;
+		}
+		rw->rw_wstreak = 0;
+		wchan_wakeall(rw->rw_rwchan);
+	}
+	else if (rw->rw_wwait > 0) {
+		wchan_wakeone(rw->rw_wwchan);
+	}
+	spinlock_release(&rw->rw_spin);
+}
+
+bool
+rwlock_do_i_write(struct rwlock *rw)
+{
+	return rw->rw_writer == curthread;
 }
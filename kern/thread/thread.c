@@ -50,8 +50,13 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <clock.h>
+#include <shrinker.h>
+#include <atomic.h>
+#include <schedtrace.h>
 
 #include "opt-synchprobs.h"
+#include "opt-schedtrace.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,8 +77,61 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Scheduler tuning. A thread at level L may run for SCHED_QUANTUM(L)
+ * hardclocks before it drops to level L+1; lower levels get longer
+ * slices. Every SCHED_RESET_HARDCLOCKS each cpu moves all of its
+ * threads back to level 0 so CPU-bound threads are never starved.
+ */
+#define SCHED_QUANTUM(level)	(1U << (level))
+#define SCHED_RESET_HARDCLOCKS	HZ
+
+/*
+ * Most threads that exit are replaced by new ones soon after, so up
+ * to this many exited threads per cpu are kept, with their stacks,
+ * for thread_fork to reuse. The thread shrinker empties the pools.
+ */
+#define THREAD_POOL_MAX		16
+
+/*
+ * Stride scheduling between processes (see proc.h). Pass values wrap
+ * around, so compare them by signed difference.
+ */
+#define PASS_BEFORE(a, b)	((int32_t)((a) - (b)) < 0)
+
+/* Affinity bit for a cpu, and the test for whether T may run on C. */
+#define CPU_BIT(c)		((uint32_t)1 << (c)->c_number)
+#define THREAD_ALLOWED(t, c)	(((t)->t_affinity & CPU_BIT(c)) != 0)
+
+/*
+ * Scheduler accounting is timed with gettime, which works only once
+ * the clock has attached; until then switches are only counted.
+ */
+static bool schedstats_running;
+
+static void thread_make_runnable(struct thread *target,
+				 bool already_have_lock);
+static struct thread *thread_steal(unsigned margin);
+static int thread_fork_affinity(const char *name, struct proc *proc,
+				void (*entrypoint)(void *, unsigned long),
+				void *data1, unsigned long data2,
+				uint32_t affinity);
+
 ////////////////////////////////////////////////////////////
 
+/*
+ * Current time for scheduler accounting, or 0 if not timing yet.
+ */
+static
+uint64_t
+schedstats_now(void)
+{
+	if (!schedstats_running) {
+		return 0;
+	}
+	return gettime_nsecs();
+}
+
 /*
  * Stick a magic number on the bottom end of the stack. This will
  * (sometimes) catch kernel stack overflows. Use thread_checkstack()
@@ -112,44 +170,250 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * The stride-scheduling pass of a thread's process. A thread on its
+ * way out of sys__exit has already left its process; treat it as
+ * being exactly on time.
+ */
+static
+uint32_t
+thread_pass(struct cpu *c, struct thread *t)
+{
+	if (t->t_proc == NULL) {
+		return c->c_pass;
+	}
+	return t->t_proc->p_pass;
+}
+
+/*
+ * The level a thread runs at: its own, or a better one lent to it
+ * through a lock it holds (see thread_inherit).
  */
+#define THREAD_LEVEL(t) \
+	((t)->t_priority < (t)->t_boost ? (t)->t_priority : (t)->t_boost)
+
+/*
+ * Run queue operations. The caller must hold the cpu's run queue
+ * lock. A thread is queued on the level given by THREAD_LEVEL.
+ * Taking from the head gets the thread with the lowest pass on the
+ * highest non-empty level (the first one queued, on ties); taking
+ * from the tail gets the last thread on the lowest level.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	struct proc *p;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(THREAD_LEVEL(t) < SCHED_NLEVELS);
+
+	/*
+	 * A process that has been asleep, or is new, has a pass that
+	 * lags behind; bring it up to date so it doesn't monopolize
+	 * the cpu until it catches up.
+	 */
+	p = t->t_proc;
+	if (p != NULL && PASS_BEFORE(p->p_pass, c->c_pass)) {
+		p->p_pass = c->c_pass;
+	}
+
+	/*
+	 * It may not run here if it is curthread yielding after
+	 * thread_setaffinity, or if its affinity changed after its
+	 * cpu was chosen; either way thread_evict moves it.
+	 */
+	if (!THREAD_ALLOWED(t, c)) {
+		c->c_evict = true;
+	}
+
+	threadlist_addtail(&c->c_runqueue[THREAD_LEVEL(t)], t);
+	c->c_runcount++;
+}
+
 static
 struct thread *
-thread_create(const char *name)
+runqueue_remhead(struct cpu *c)
 {
-	struct thread *thread;
+	struct threadlistnode *tln;
+	struct thread *t, *stuck;
+	uint32_t pass, bestpass;
+	unsigned i, stucklevel;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	stuck = NULL;
+	stucklevel = 0;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = NULL;
+		bestpass = 0;
+		for (tln = c->c_runqueue[i].tl_head.tln_next;
+		     tln->tln_next != NULL; tln = tln->tln_next) {
+			if (!THREAD_ALLOWED(tln->tln_self, c)) {
+				/* left for thread_evict */
+				if (tln->tln_self == c->c_curthread) {
+					stuck = tln->tln_self;
+					stucklevel = i;
+				}
+				continue;
+			}
+			pass = thread_pass(c, tln->tln_self);
+			if (t == NULL || PASS_BEFORE(pass, bestpass)) {
+				t = tln->tln_self;
+				bestpass = pass;
+			}
+		}
+		if (t != NULL) {
+			threadlist_remove(&c->c_runqueue[i], t);
+			c->c_runcount--;
+			if (PASS_BEFORE(c->c_pass, bestpass)) {
+				c->c_pass = bestpass;
+			}
+			return t;
+		}
+	}
 
-	DEBUGASSERT(name != NULL);
+	/*
+	 * Our idle loop is running on curthread's stack, so if it is
+	 * queued here it can't be sent elsewhere; as a last resort let
+	 * it keep running here until something else turns up.
+	 */
+	if (stuck != NULL) {
+		threadlist_remove(&c->c_runqueue[stucklevel], stuck);
+		c->c_runcount--;
+		return stuck;
+	}
+	return NULL;
+}
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Return the highest level with a runnable thread on it, or
+ * SCHED_NLEVELS if the run queues are empty.
+ */
+static
+unsigned
+runqueue_toplevel(struct cpu *c)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			break;
+		}
 	}
+	return i;
+}
 
+/*
+ * Set a thread's name. Short names are copied into the thread; only
+ * long ones need memory.
+ */
+static
+int
+thread_setname(struct thread *thread, const char *name)
+{
+	if (strlen(name) < sizeof(thread->t_namebuf)) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
+		return 0;
+	}
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
 	}
+	return 0;
+}
+
+static
+void
+thread_freename(struct thread *thread)
+{
+	if (thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
+	}
+	thread->t_name = NULL;
+}
+
+/*
+ * Set up everything in a thread except its name and stack, for a new
+ * thread or one being reused from the thread pool.
+ */
+static
+void
+thread_init(struct thread *thread)
+{
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_ustack = -1;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduler fields: new threads start at the top level */
+	thread->t_priority = 0;
+	thread->t_quantum = SCHED_QUANTUM(0);
+	thread->t_lastrun = 0;
+	thread->t_affinity = THREAD_AFFINITY_ANY;
+	thread->t_boost = SCHED_NLEVELS;
+	thread->t_locks = NULL;
+	bzero(&thread->t_stats, sizeof(thread->t_stats));
+	thread->t_stamp = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	DEBUGASSERT(name != NULL);
+
+	thread = kmalloc(sizeof(*thread));
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (thread_setname(thread, name)) {
+		kfree(thread);
+		return NULL;
+	}
+	thread->t_stack = NULL;
+	thread_init(thread);
 
 	return thread;
 }
@@ -167,6 +431,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -178,12 +443,26 @@ cpu_create(unsigned hardware_number)
 	c->c_hardware_number = hardware_number;
 
 	c->c_curthread = NULL;
+	c->c_migratechan = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_lastreset = 0;
+	c->c_lastas = NULL;
+	c->c_tlbflushes = 0;
+	c->c_tlbskips = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
-	spinlock_init(&c->c_runqueue_lock);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+	c->c_pass = 0;
+	c->c_evict = false;
+	bzero(&c->c_stats, sizeof(c->c_stats));
+	threadlist_init(&c->c_threadpool);
+	spinlock_init(&c->c_threadpool_lock);
+	/* stealing cpus contend for this one; keep them in order */
+	spinlock_init_ticket(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -227,6 +506,26 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * A stale c_lastas only costs a flush, so there's no need to be
+ * atomic with a cpu that is switching address spaces right now; it
+ * can't be switching to AS, which is being destroyed.
+ */
+void
+cpu_forget_as(struct addrspace *as)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_lastas == as) {
+			c->c_lastas = NULL;
+		}
+	}
+}
+
 /*
  * Destroy a thread.
  *
@@ -258,10 +557,106 @@ thread_destroy(struct thread *thread)
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
+	thread_freename(thread);
 	kfree(thread);
 }
 
+/*
+ * Put an exited thread in this cpu's thread pool instead of
+ * destroying it. Returns false if it can't be kept. The stack guard
+ * band is checked here; since it is intact it needn't be rewritten
+ * when the thread is reused.
+ */
+static
+bool
+thread_pool_put(struct thread *thread)
+{
+	struct cpu *c;
+
+	KASSERT(thread->t_proc == NULL);
+
+	if (thread->t_stack == NULL) {
+		/* boot stack; see cpu_create */
+		return false;
+	}
+	thread_checkstack(thread);
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_threadpool_lock);
+	if (c->c_threadpool.tl_count >= THREAD_POOL_MAX) {
+		spinlock_release(&c->c_threadpool_lock);
+		return false;
+	}
+	thread->t_wchan_name = "POOL";
+	threadlist_addtail(&c->c_threadpool, thread);
+	spinlock_release(&c->c_threadpool_lock);
+	return true;
+}
+
+/*
+ * Take a thread, with its stack, from this cpu's thread pool and set
+ * it up as if new. Returns NULL if the pool is empty.
+ */
+static
+struct thread *
+thread_pool_get(const char *name)
+{
+	struct cpu *c;
+	struct thread *thread;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_threadpool_lock);
+	thread = threadlist_remhead(&c->c_threadpool);
+	spinlock_release(&c->c_threadpool_lock);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+	thread_freename(thread);
+	thread_init(thread);
+	if (thread_setname(thread, name)) {
+		thread->t_name = thread->t_namebuf;
+		thread_destroy(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+/*
+ * Destroy the threads in every cpu's pool. Returns the number of
+ * stack pages freed.
+ */
+static
+unsigned
+thread_pool_drain(void)
+{
+	struct threadlist drained;
+	struct thread *thread;
+	struct cpu *c;
+	unsigned i, numcpus, npages;
+
+	threadlist_init(&drained);
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_threadpool_lock);
+		while ((thread = threadlist_remhead(&c->c_threadpool)) != NULL) {
+			threadlist_addtail(&drained, thread);
+		}
+		spinlock_release(&c->c_threadpool_lock);
+	}
+
+	npages = 0;
+	while ((thread = threadlist_remhead(&drained)) != NULL) {
+		thread_destroy(thread);
+		npages += STACK_SIZE / PAGE_SIZE;
+	}
+	threadlist_cleanup(&drained);
+	return npages;
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
  * need to have thread_destroy called on them.)
@@ -277,10 +672,34 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!thread_pool_put(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
+/*
+ * Shrinker: zombies normally wait for the next thread switch on their
+ * cpu to be exorcised. Under memory pressure do it now, and then empty
+ * the thread pools, so their stacks can be reused. Only this cpu's
+ * zombie list can be touched safely.
+ */
+static
+unsigned
+thread_shrink_threads(void *data, unsigned npages)
+{
+	int spl;
+
+	(void)data;
+	(void)npages;
+
+	spl = splhigh();
+	exorcise();
+	splx(spl);
+
+	return thread_pool_drain();
+}
+
 /*
  * On panic, stop the thread system (as much as is reasonably
  * possible) to make sure we don't end up letting any other threads
@@ -289,6 +708,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +724,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -380,6 +804,8 @@ thread_bootstrap(void)
 	/* cpu_create() should have set t_proc. */
 	KASSERT(curthread->t_proc != NULL);
 
+	shrinker_register("threads", thread_shrink_threads, NULL, 0);
+
 	/* Done */
 }
 
@@ -406,6 +832,56 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+/*
+ * Return the number of cpus in the system.
+ */
+unsigned
+thread_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * A thread that has to leave a cpu (see thread_setaffinity) can only
+ * be moved once the cpu is running on some other stack, and if
+ * nothing else is runnable there the cpu would idle on its stack
+ * instead. So each cpu has a migrator, pinned to it, that sleeps on
+ * c_migratechan; thread_yield wakes it to give the cpu something to
+ * switch to. It does nothing else.
+ */
+static
+void
+thread_migrator(void *data1, unsigned long data2)
+{
+	struct cpu *c = data1;
+
+	(void)data2;
+
+	while (1) {
+		wchan_lock(c->c_migratechan);
+		wchan_sleep(c->c_migratechan);
+	}
+}
+
+static
+void
+thread_migrator_start(struct cpu *c)
+{
+	char name[32];
+	int result;
+
+	c->c_migratechan = wchan_create("migrate");
+	if (c->c_migratechan == NULL) {
+		panic("thread_migrator_start: out of memory\n");
+	}
+	snprintf(name, sizeof(name), "<migrate #%u>", c->c_number);
+	result = thread_fork_affinity(name, NULL, thread_migrator, c, 0,
+				      CPU_BIT(c));
+	if (result) {
+		panic("thread_migrator_start: %s\n", strerror(result));
+	}
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -424,12 +900,240 @@ thread_start_cpus(void)
 	}
 	sem_destroy(cpu_startup_sem);
 	cpu_startup_sem = NULL;
+
+	if (cpuarray_num(&allcpus) > 1) {
+		for (i=0; i<cpuarray_num(&allcpus); i++) {
+			thread_migrator_start(cpuarray_get(&allcpus, i));
+		}
+	}
+}
+
+/*
+ * Send an unidle IPI to some idle cpu other than BUSY, so it runs
+ * thread_steal. c_isidle is read without the lock; a wrong guess
+ * costs one spurious interrupt or one missed chance to steal early.
+ */
+static
+void
+thread_unidle_peer(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * The address space a thread will activate when it runs, or NULL for
+ * kernel threads. Read without the proc lock; it's only a hint for
+ * placement, compared against c_lastas and never dereferenced.
+ */
+static
+struct addrspace *
+thread_as(struct thread *t)
+{
+	return t->t_proc == NULL ? NULL : t->t_proc->p_addrspace;
+}
+
+/*
+ * True if C's TLB still holds T's address space, so running T there
+ * won't cost a flush. Kernel threads don't care where they run.
+ */
+static
+bool
+thread_ashot(struct thread *t, struct cpu *c)
+{
+	struct addrspace *as;
+
+	as = thread_as(t);
+	return as != NULL && c->c_lastas == as;
+}
+
+/*
+ * Choose a cpu for a thread that may not run where it last ran:
+ * an allowed idle cpu if there is one, otherwise the allowed cpu
+ * with the shortest run queue (both read without locking). Either
+ * way, a cpu whose TLB already holds the thread's address space wins
+ * ties.
+ */
+static
+struct cpu *
+thread_pickcpu(struct thread *t)
+{
+	struct cpu *c, *best, *idle;
+	unsigned i, numcpus;
+
+	best = idle = NULL;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!THREAD_ALLOWED(t, c)) {
+			continue;
+		}
+		if (c->c_isidle) {
+			if (thread_ashot(t, c)) {
+				return c;
+			}
+			if (idle == NULL) {
+				idle = c;
+			}
+			continue;
+		}
+		if (best == NULL || c->c_runcount < best->c_runcount ||
+		    (c->c_runcount == best->c_runcount &&
+		     thread_ashot(t, c) && !thread_ashot(t, best))) {
+			best = c;
+		}
+	}
+	if (idle != NULL) {
+		return idle;
+	}
+	/* thread_setaffinity doesn't accept masks with no cpus in them */
+	KASSERT(best != NULL);
+	return best;
+}
+
+/*
+ * Choose a cpu for a thread being woken up. Its last cpu is best if
+ * that's idle, since its cache may still be warm; failing that an
+ * idle cpu gets it running soonest, preferably one that last ran
+ * its address space. Cpus in CLAIMED are treated as busy (they're
+ * getting another thread from the same wakeup). With no idle cpu it
+ * stays where it was, if it may.
+ *
+ * A sleeper can be on a wait channel before it has finished switching
+ * out on its last cpu, and must not be run anywhere else until it
+ * has. That cpu holds its run queue lock throughout the switch,
+ * except while idling on the sleeper's stack, when the sleeper is
+ * still its c_curthread; so check under the lock before moving it.
+ * If it's stuck there although it may no longer run there, it is
+ * queued there anyway and thread_evict moves it later.
+ */
+static
+struct cpu *
+thread_wakecpu(struct thread *t, uint32_t claimed)
+{
+	struct cpu *c, *last, *idle;
+	unsigned i, numcpus;
+	bool stuck;
+
+	last = t->t_cpu;
+	if (THREAD_ALLOWED(t, last) && last->c_isidle &&
+	    (claimed & CPU_BIT(last)) == 0) {
+		return last;
+	}
+
+	idle = NULL;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == last || !THREAD_ALLOWED(t, c) || !c->c_isidle ||
+		    (claimed & CPU_BIT(c)) != 0) {
+			continue;
+		}
+		if (idle == NULL || thread_ashot(t, c)) {
+			idle = c;
+			if (thread_ashot(t, c)) {
+				break;
+			}
+		}
+	}
+	if (idle == NULL) {
+		if (THREAD_ALLOWED(t, last)) {
+			return last;
+		}
+		idle = thread_pickcpu(t);
+	}
+
+	spinlock_acquire(&last->c_runqueue_lock);
+	stuck = last->c_curthread == t;
+	spinlock_release(&last->c_runqueue_lock);
+	return stuck ? last : idle;
+}
+
+/*
+ * Move queued threads that may no longer run on this cpu to a cpu
+ * where they can. Called with interrupts off and without the run
+ * queue lock, at points where the thread that queued itself here
+ * has finished switching out. curthread is skipped, since this cpu
+ * may be idling on its stack.
+ */
+static
+void
+thread_evict(void)
+{
+	struct cpu *c;
+	struct thread *t;
+	struct threadlistnode *tln, *nexttln;
+	struct threadlist evicted;
+	unsigned i;
+
+	c = curcpu->c_self;
+	threadlist_init(&evicted);
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	c->c_evict = false;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		for (tln = c->c_runqueue[i].tl_head.tln_next;
+		     tln->tln_next != NULL; tln = nexttln) {
+			nexttln = tln->tln_next;
+			t = tln->tln_self;
+			if (THREAD_ALLOWED(t, c)) {
+				continue;
+			}
+			if (t == c->c_curthread) {
+				c->c_evict = true;
+				continue;
+			}
+			threadlist_remove(&c->c_runqueue[i], t);
+			c->c_runcount--;
+			threadlist_addtail(&evicted, t);
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+
+	while ((t = threadlist_remhead(&evicted)) != NULL) {
+		thread_make_runnable(t, false);
+	}
+	threadlist_cleanup(&evicted);
+}
+
+/*
+ * Get cpu C to notice that a thread has just been queued on it. If
+ * it was idle (WASIDLE), interrupt it; if work is piling up on it,
+ * get an idle cpu, if any, to come and steal some. Call with C's run
+ * queue lock held.
+ */
+static
+void
+runqueue_kick(struct cpu *c, bool wasidle)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (wasidle) {
+		ipi_send(c, IPI_UNIDLE);
+	}
+	else if (c->c_runcount >= 2) {
+		thread_unidle_peer(c);
+	}
 }
 
 /*
  * Make a thread runnable.
  *
  * targetcpu might be curcpu; it might not be, too. 
+ *
+ * If the thread may not run on its last cpu (see thread_setaffinity)
+ * it goes to one where it can, except when it is curthread yielding;
+ * then it is queued here and thread_evict moves it once it has
+ * switched out.
  */
 static
 void
@@ -442,28 +1146,95 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	targetcpu = target->t_cpu;
 
 	if (already_have_lock) {
-		/* The target thread's cpu should be already locked. */
+		/*
+		 * The target thread's cpu should be already locked.
+		 * This is curthread yielding; if it may no longer run
+		 * here it still can't go to another cpu until it has
+		 * switched out, so runqueue_add has it moved afterwards.
+		 */
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
 	}
 	else {
+		if (target->t_state == S_SLEEP) {
+			targetcpu = thread_wakecpu(target, 0);
+		}
+		else if (!THREAD_ALLOWED(target, targetcpu)) {
+			targetcpu = thread_pickcpu(target);
+		}
+		if (targetcpu != target->t_cpu) {
+			target->t_cpu = targetcpu;
+			target->t_stats.ss_nmigrate++;
+			atomic_add(&targetcpu->c_stats.ss_nmigrate, 1);
+		}
+		if (target->t_state != S_READY || target->t_stamp == 0) {
+			/* woken or new: it starts waiting now */
+			target->t_stamp = schedstats_now();
+		}
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
-	if (isidle) {
-		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
-		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
-	}
+	runqueue_add(targetcpu, target);
+	runqueue_kick(targetcpu, isidle);
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
 }
 
+/*
+ * Make a list of woken threads runnable. Each gets a cpu from
+ * thread_wakecpu, spreading them over the idle cpus; then they are
+ * queued a cpu at a time, so each run queue is locked once and each
+ * cpu is kicked at most once however many threads it gets.
+ */
+static
+void
+thread_make_runnable_list(struct threadlist *list)
+{
+	struct threadlistnode *tln, *nexttln;
+	struct thread *t;
+	struct cpu *c;
+	uint32_t claimed;
+	uint64_t now;
+	bool isidle;
+
+	claimed = 0;
+	now = schedstats_now();
+	for (tln = list->tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		t = tln->tln_self;
+		c = thread_wakecpu(t, claimed);
+		if (c != t->t_cpu) {
+			t->t_cpu = c;
+			t->t_stats.ss_nmigrate++;
+			atomic_add(&c->c_stats.ss_nmigrate, 1);
+		}
+		if (c->c_isidle) {
+			claimed |= CPU_BIT(c);
+		}
+		t->t_stamp = now;
+	}
+
+	while ((t = threadlist_remhead(list)) != NULL) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		isidle = c->c_isidle;
+		runqueue_add(c, t);
+		for (tln = list->tl_head.tln_next; tln->tln_next != NULL;
+		     tln = nexttln) {
+			nexttln = tln->tln_next;
+			t = tln->tln_self;
+			if (t->t_cpu == c) {
+				threadlist_remove(list, t);
+				runqueue_add(c, t);
+			}
+		}
+		runqueue_kick(c, isidle);
+		spinlock_release(&c->c_runqueue_lock);
+	}
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -479,6 +1250,21 @@ thread_fork(const char *name,
 	    struct proc *proc,
 	    void (*entrypoint)(void *data1, unsigned long data2),
 	    void *data1, unsigned long data2)
+{
+	return thread_fork_affinity(name, proc, entrypoint, data1, data2,
+				    curthread->t_affinity);
+}
+
+/*
+ * thread_fork, but the new thread runs only on the cpus in AFFINITY
+ * from the start.
+ */
+static
+int
+thread_fork_affinity(const char *name,
+		     struct proc *proc,
+		     void (*entrypoint)(void *data1, unsigned long data2),
+		     void *data1, unsigned long data2, uint32_t affinity)
 {
 	struct thread *newthread;
 	int result;
@@ -487,18 +1273,22 @@ thread_fork(const char *name,
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
-	newthread = thread_create(name);
+	/* Reuse an exited thread and its stack if there is one */
+	newthread = thread_pool_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -506,6 +1296,7 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = affinity;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -548,6 +1339,8 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
+	uint64_t now, ran, waited;
+	bool idled;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -573,13 +1366,41 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. But not
+	 * if we may no longer run here: then we must be queued, so
+	 * that c_evict gets set and we're moved (see thread_yield).
+	 */
+	if (newstate == S_READY && curcpu->c_runcount == 0 &&
+	    THREAD_ALLOWED(cur, curcpu)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* Remember when it last ran, for thread_steal. */
+	cur->t_lastrun = curcpu->c_hardclocks;
+
+	/*
+	 * Charge cur for its run. This has to happen before it is
+	 * queued, as another cpu may take it from there; its stamp
+	 * now marks the start of its wait if it stays runnable, and
+	 * is reset when it's woken otherwise.
+	 */
+	now = schedstats_now();
+	ran = (now != 0 && cur->t_stamp != 0) ? now - cur->t_stamp : 0;
+	cur->t_stats.ss_runtime += ran;
+	curcpu->c_stats.ss_runtime += ran;
+	if (newstate == S_READY) {
+		cur->t_stats.ss_nivcsw++;
+		curcpu->c_stats.ss_nivcsw++;
+	}
+	else {
+		cur->t_stats.ss_nvcsw++;
+		curcpu->c_stats.ss_nvcsw++;
+	}
+	cur->t_stamp = now;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -631,15 +1452,42 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	idled = false;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (curcpu->c_evict) {
+				thread_evict();
+			}
+			next = thread_steal(0);
+			if (next == NULL) {
+				/*
+				 * Nothing to timeslice, so don't take
+				 * hardclocks until there is. Wakeups
+				 * come by IPI or the timerclock.
+				 */
+				mainbus_hardclock_stop();
+				idled = true;
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	if (idled) {
+		mainbus_hardclock_start();
+		now = schedstats_now();
+	}
+
+	/* Charge next for its wait; it starts running now. */
+	waited = (now != 0 && next->t_stamp != 0) ? now - next->t_stamp : 0;
+	next->t_stats.ss_waittime += waited;
+	curcpu->c_stats.ss_waittime += waited;
+	next->t_stamp = now;
+#if OPT_SCHEDTRACE
+	schedtrace_record(curcpu->c_number, cur, newstate, next, now, waited);
+#endif
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -708,6 +1556,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send away threads that were queued here but can't run here. */
+	if (curcpu->c_evict) {
+		thread_evict();
+	}
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -741,6 +1594,11 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send away threads that were queued here but can't run here. */
+	if (curcpu->c_evict) {
+		thread_evict();
+	}
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -799,6 +1657,9 @@ thread_exit(void)
 	/* Make sure we *are* detached (move this only if you're sure!) */
 	KASSERT(cur->t_proc == NULL);
 
+	/* Lock waiters may look at a lock's owner; see lock_owner_running. */
+	KASSERT(cur->t_locks == NULL);
+
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
@@ -814,9 +1675,187 @@ thread_exit(void)
 void
 thread_yield(void)
 {
+	struct wchan *wc;
+
+	/*
+	 * If we may no longer run here (see thread_setaffinity), we
+	 * can only be moved once this cpu has switched to another
+	 * stack; wake its migrator so there is one to switch to.
+	 * thread_switch queues us with c_evict set and thread_evict
+	 * sends us on from the migrator's stack.
+	 */
+	wc = curcpu->c_migratechan;
+	if (wc != NULL && !THREAD_ALLOWED(curthread, curcpu)) {
+		wchan_wakeone(wc);
+	}
 	thread_switch(S_READY, NULL);
 }
 
+/*
+ * Charge the current thread for a hardclock. Its process's pass
+ * advances by its stride. When its quantum runs out it drops a level,
+ * so CPU-bound threads sink below interactive ones, and goes to the
+ * back of its new queue. It is also preempted early if a thread at a
+ * higher level has become runnable.
+ */
+void
+thread_timeslice(void)
+{
+	struct thread *cur;
+	bool preempt;
+
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* cur is asleep; there is nothing to charge */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+	if (cur->t_proc != NULL) {
+		/*
+		 * Not locked: threads of one process running on
+		 * different cpus can race here, which at worst loses
+		 * a tick's worth of charge.
+		 */
+		cur->t_proc->p_pass += PROC_STRIDE1 / cur->t_proc->p_tickets;
+	}
+	if (cur->t_quantum > 0) {
+		cur->t_quantum--;
+	}
+	if (cur->t_quantum == 0) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_quantum = SCHED_QUANTUM(cur->t_priority);
+		preempt = true;
+	}
+	else {
+		/* also go now if we've been told to leave this cpu */
+		preempt = runqueue_toplevel(curcpu->c_self) < THREAD_LEVEL(cur)
+			|| !THREAD_ALLOWED(cur, curcpu);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * A thread being woken up gave the cpu away before its quantum ran
+ * out, which is how interactive and I/O-bound threads behave: move it
+ * up a level and give it a fresh quantum. The caller owns T (it has
+ * been taken off its wait channel and is not yet runnable).
+ */
+static
+void
+thread_boost(struct thread *t)
+{
+	if (t->t_priority > 0) {
+		t->t_priority--;
+	}
+	t->t_quantum = SCHED_QUANTUM(t->t_priority);
+}
+
+/*
+ * Priority inheritance.
+ *
+ * A thread about to sleep on a lock lends its level to the owner
+ * (thread_inherit), so that a low-priority owner can't be kept off
+ * the cpu indefinitely by mid-priority threads while a high-priority
+ * thread waits for it. The lent level is kept in t_boost and only
+ * ever improved by lenders; the owner drops it when it releases a
+ * lock (thread_disinherit), falling back to whatever is still lent
+ * through the other locks it holds. Lending is one level deep: if
+ * the owner is itself asleep on another lock, that lock's owner is
+ * not boosted.
+ *
+ * t_boost is changed under the run queue lock of the thread's cpu.
+ */
+
+/*
+ * Lock the run queue of T's cpu. T may be migrating, so recheck
+ * t_cpu once we have the lock.
+ */
+static
+struct cpu *
+thread_lockcpu(struct thread *t)
+{
+	struct cpu *c;
+
+	while (1) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			return c;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+}
+
+unsigned
+thread_level(struct thread *t)
+{
+	return THREAD_LEVEL(t);
+}
+
+void
+thread_inherit(struct thread *t, unsigned level)
+{
+	struct threadlistnode *tln;
+	struct cpu *c;
+	unsigned i, old;
+
+	KASSERT(level <= SCHED_NLEVELS);
+
+	c = thread_lockcpu(t);
+	old = THREAD_LEVEL(t);
+	if (level < t->t_boost) {
+		t->t_boost = level;
+	}
+	if (THREAD_LEVEL(t) < old) {
+		/*
+		 * If it's waiting to run here, move it up. (If it's
+		 * running, asleep, or on its way between cpus, the new
+		 * level applies when it's next queued.)
+		 */
+		for (i=old; i<SCHED_NLEVELS; i++) {
+			for (tln = c->c_runqueue[i].tl_head.tln_next;
+			     tln->tln_next != NULL; tln = tln->tln_next) {
+				if (tln->tln_self == t) {
+					break;
+				}
+			}
+			if (tln->tln_next != NULL) {
+				threadlist_remove(&c->c_runqueue[i], t);
+				threadlist_addtail(
+					&c->c_runqueue[THREAD_LEVEL(t)], t);
+				break;
+			}
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+void
+thread_disinherit(void)
+{
+	struct lock *lock;
+	struct cpu *c;
+	unsigned level;
+
+	c = thread_lockcpu(curthread);
+	level = SCHED_NLEVELS;
+	for (lock = curthread->t_locks; lock != NULL; lock = lock->lock_next) {
+		if (lock->lock_prio < level) {
+			level = lock->lock_prio;
+		}
+	}
+	curthread->t_boost = level;
+	spinlock_release(&c->c_runqueue_lock);
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -824,137 +1863,308 @@ thread_yield(void)
  *
  * This is called periodically from hardclock(). It should reshuffle
  * the current CPU's run queue by job priority.
+ *
+ * Priorities are a multi-level feedback queue: each cpu has
+ * SCHED_NLEVELS run queues and always runs from the highest non-empty
+ * one, round-robin within a level. Threads start at level 0, drop a
+ * level each time they use up a quantum (thread_timeslice) and move
+ * up a level when woken from sleep (thread_boost). The rest is done
+ * here: every SCHED_RESET_HARDCLOCKS, put everything back on level 0
+ * so threads that have sunk to the bottom get to run, and threads
+ * whose behavior has changed get reclassified.
  */
 
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct cpu *c;
+	struct thread *t;
+	unsigned i;
+
+	c = curcpu->c_self;
+	if (c->c_hardclocks - c->c_lastreset < SCHED_RESET_HARDCLOCKS) {
+		return;
+	}
+	c->c_lastreset = c->c_hardclocks;
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&c->c_runqueue[i])) != NULL) {
+			t->t_priority = 0;
+			t->t_quantum = SCHED_QUANTUM(0);
+			threadlist_addtail(&c->c_runqueue[0], t);
+		}
+	}
+	if (!c->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_quantum = SCHED_QUANTUM(0);
+	}
+	spinlock_release(&c->c_runqueue_lock);
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Load is balanced by pulling rather than pushing: a cpu with nothing
+ * to run steals a thread from the busiest other cpu before it idles
+ * (see thread_switch), and every MIGRATE_HARDCLOCKS a busy cpu checks
+ * whether some peer has noticeably more queued work than it does.
+ * thread_make_runnable pokes an idle cpu when a queue backs up, so
+ * idle cpus don't have to wait for their next timer tick.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * which is fairly slow. So we steal from the tail (lowest level,
+ * longest until it would run anyway) and leave threads that were
+ * running within the last STEAL_HOT_HARDCLOCKS alone. System/161
+ * doesn't model caches, but a real machine would.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * To find a victim, peers' c_runcount is read without locking; it's
+ * only a hint and is rechecked under the victim's lock. Only one run
+ * queue lock is held at a time.
  */
-void
-thread_consider_migration(void)
+#define STEAL_HOT_HARDCLOCKS	2
+
+/*
+ * Try to take one thread from the busiest other cpu whose run queue is
+ * at least MARGIN threads longer than ours. Returns the thread, now
+ * belonging to this cpu but not on any run queue, or NULL. Must be
+ * called with interrupts off and without our own run queue lock.
+ */
+static
+struct thread *
+thread_steal(unsigned margin)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
+	struct cpu *c, *victim;
 	struct thread *t;
+	struct threadlistnode *tln;
+	unsigned i, numcpus, mycount, count, best, level;
 
-	my_count = total_count = 0;
+	KASSERT(curthread->t_iplhigh_count > 0);
+	KASSERT(!spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	/* Pick a victim using unlocked reads of the queue lengths. */
+	mycount = curcpu->c_runcount;
+	victim = NULL;
+	best = mycount + margin;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c == curcpu->c_self || c->c_isidle) {
+			/* an idle cpu is about to run what it has */
+			continue;
+		}
+		count = c->c_runcount;
+		if (count > 0 && count >= best) {
+			victim = c;
+			best = count + 1;
 		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
 	}
-
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	if (victim == NULL) {
+		return NULL;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
+	/*
+	 * Take the coldest thread from the tail of its lowest level,
+	 * unless one in the same level uses the address space our TLB
+	 * already holds.
+	 */
+	t = NULL;
+	level = 0;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	for (i=SCHED_NLEVELS; i-- > 0 && t == NULL; ) {
+		for (tln = victim->c_runqueue[i].tl_tail.tln_prev;
+		     tln->tln_prev != NULL; tln = tln->tln_prev) {
 			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
+			 * The victim's curthread can be on its run
+			 * queue if it went idle and was woken again
+			 * before unidling; it mustn't be migrated.
 			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
+			if (tln->tln_self == victim->c_curthread) {
+				continue;
+			}
+			if (!THREAD_ALLOWED(tln->tln_self, curcpu)) {
 				continue;
 			}
+			if (victim->c_hardclocks - tln->tln_self->t_lastrun <
+			    STEAL_HOT_HARDCLOCKS) {
+				continue;
+			}
+			if (t == NULL) {
+				t = tln->tln_self;
+				level = i;
+			}
+			if (thread_ashot(tln->tln_self, curcpu->c_self)) {
+				t = tln->tln_self;
+				break;
+			}
+		}
+	}
+	if (t != NULL) {
+		threadlist_remove(&victim->c_runqueue[level], t);
+		victim->c_runcount--;
+		t->t_cpu = curcpu->c_self;
+		t->t_stats.ss_nmigrate++;
+		atomic_add(&curcpu->c_stats.ss_nmigrate, 1);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
+	if (t != NULL) {
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	return t;
+}
+
+int
+thread_setaffinity(struct thread *t, uint32_t mask)
+{
+	struct cpu *c;
+	uint32_t allmask;
+	unsigned numcpus;
+	bool moving;
+	int spl;
+
+	numcpus = cpuarray_num(&allcpus);
+	allmask = numcpus >= 32 ? THREAD_AFFINITY_ANY :
+		((uint32_t)1 << numcpus) - 1;
+	if ((mask & allmask) == 0) {
+		return EINVAL;
+	}
+
+	if (t != curthread) {
+		/*
+		 * Change it under its cpu's run queue lock, rechecking
+		 * that it hasn't moved meanwhile. If it's queued where
+		 * it may no longer run, get that cpu to send it away;
+		 * if it's being queued right now, runqueue_add does.
+		 * If it's running or asleep it will be placed correctly
+		 * when next made runnable.
+		 */
+		while (1) {
+			c = t->t_cpu;
+			spinlock_acquire(&c->c_runqueue_lock);
+			if (t->t_cpu == c) {
+				break;
+			}
+			spinlock_release(&c->c_runqueue_lock);
+		}
+		t->t_affinity = mask;
+		if (!THREAD_ALLOWED(t, c)) {
+			c->c_evict = true;
 			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
 				ipi_send(c, IPI_UNIDLE);
 			}
 		}
 		spinlock_release(&c->c_runqueue_lock);
+		return 0;
 	}
 
 	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
+	 * We can only leave this cpu once we've switched out. So yield:
+	 * thread_yield makes sure there is something else to run here
+	 * (this cpu's migrator, if need be), runqueue_add queues us
+	 * with c_evict set, and thread_evict sends us on. Interrupts
+	 * stay off from the check on, so we can't be moved in between.
 	 */
-	if (!threadlist_isempty(&victims)) {
+	spl = splhigh();
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_runqueue_lock);
+	t->t_affinity = mask;
+	moving = !THREAD_ALLOWED(t, c);
+	spinlock_release(&c->c_runqueue_lock);
+	if (moving) {
+		thread_yield();
+	}
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Called periodically from hardclock() on a cpu that is not idle. If
+ * some other cpu has at least two more threads waiting than we do,
+ * pull one of them over.
+ */
+void
+thread_consider_migration(void)
+{
+	struct thread *t;
+	int spl;
+
+	spl = splhigh();
+	t = thread_steal(2);
+	if (t != NULL) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
+		runqueue_add(curcpu->c_self, t);
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+	splx(spl);
+}
+
+/*
+ * Start timing. Called from boot() once the clock is attached.
+ */
+void
+schedstats_bootstrap(void)
+{
+	schedstats_running = true;
+}
+
+void
+schedstats_add(struct schedstats *to, const struct schedstats *from)
+{
+	to->ss_runtime += from->ss_runtime;
+	to->ss_waittime += from->ss_waittime;
+	to->ss_nvcsw += from->ss_nvcsw;
+	to->ss_nivcsw += from->ss_nivcsw;
+	to->ss_nmigrate += from->ss_nmigrate;
+}
+
+/*
+ * Fetch T's accounting. The current thread's includes the run it's
+ * in the middle of; other threads' are as of their last switch.
+ */
+void
+thread_getstats(struct thread *t, struct schedstats *ret)
+{
+	uint64_t now;
+	int spl;
+
+	spl = splhigh();
+	*ret = t->t_stats;
+	if (t == curthread) {
+		now = schedstats_now();
+		if (now != 0 && t->t_stamp != 0) {
+			ret->ss_runtime += now - t->t_stamp;
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * Print the per-cpu totals.
+ */
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	struct schedstats ss;
+	unsigned i, numcpus;
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	kprintf("%3s %9s %9s %9s %9s %9s %9s %9s\n", "cpu",
+		"run(ms)", "wait(ms)", "vcsw", "ivcsw", "migrated",
+		"tlbflush", "tlbskip");
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		ss = c->c_stats;
+		spinlock_release(&c->c_runqueue_lock);
+		kprintf("%3u %9llu %9llu %9u %9u %9u %9u %9u\n", c->c_number,
+			ss.ss_runtime / 1000000, ss.ss_waittime / 1000000,
+			ss.ss_nvcsw, ss.ss_nivcsw, ss.ss_nmigrate,
+			c->c_tlbflushes, c->c_tlbskips);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1050,6 +2260,21 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
+	thread_boost(target);
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Wake up a particular thread sleeping on a wait channel.
+ */
+void
+wchan_wakethread(struct wchan *wc, struct thread *target)
+{
+	spinlock_acquire(&wc->wc_lock);
+	threadlist_remove(&wc->wc_threads, target);
+	spinlock_release(&wc->wc_lock);
+
+	thread_boost(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1060,6 +2285,7 @@ void
 wchan_wakeall(struct wchan *wc)
 {
 	struct thread *target;
+	struct threadlistnode *tln;
 	struct threadlist list;
 
 	threadlist_init(&list);
@@ -1079,17 +2305,63 @@ wchan_wakeall(struct wchan *wc)
 	spinlock_release(&wc->wc_lock);
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Boost them all, then hand them out by cpu, for fewer lock
+	 * ops and fewer IPIs.
 	 */
-	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+	for (tln = list.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		thread_boost(tln->tln_self);
 	}
+	thread_make_runnable_list(&list);
 
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Move sleepers from one wait channel to another.
+ */
+unsigned
+wchan_transfer(struct wchan *from, struct wchan *to, bool all)
+{
+	struct thread *target;
+	unsigned count;
+
+	KASSERT(from != to);
+
+	count = 0;
+	spinlock_acquire(&from->wc_lock);
+	spinlock_acquire(&to->wc_lock);
+	while ((target = threadlist_remhead(&from->wc_threads)) != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+		count++;
+		if (!all) {
+			break;
+		}
+	}
+	spinlock_release(&to->wc_lock);
+	spinlock_release(&from->wc_lock);
+	return count;
+}
+
+unsigned
+wchan_toplevel(struct wchan *wc)
+{
+	struct threadlistnode *tln;
+	unsigned level;
+
+	level = SCHED_NLEVELS;
+	spinlock_acquire(&wc->wc_lock);
+	for (tln = wc->wc_threads.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		if (THREAD_LEVEL(tln->tln_self) < level) {
+			level = THREAD_LEVEL(tln->tln_self);
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+	return level;
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Workqueues. See workqueue.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <cpu.h>
+#include <clock.h>
+#include <workqueue.h>
+
+/*
+ * One of these per cpu. The counters only grow (and wrap), so a
+ * flusher can wait for ndone to catch up with the nsubmit it saw.
+ */
+struct workqueue {
+	struct spinlock wq_lock;
+	struct work *wq_head;		/* FIFO of pending items */
+	struct work *wq_tail;
+	struct wchan *wq_wchan;		/* worker sleeps here when idle */
+	struct wchan *wq_flushchan;	/* workqueue_flush sleeps here */
+
+	/* statistics */
+	unsigned wq_nsubmit;		/* items queued */
+	unsigned wq_ndone;		/* items finished */
+	unsigned wq_depth;		/* items queued now */
+	unsigned wq_maxdepth;		/* most ever queued at once */
+};
+
+static struct workqueue *workqueues;
+static unsigned numworkqueues;
+
+void
+work_init(struct work *w, void (*func)(void *), void *data)
+{
+	w->w_next = NULL;
+	w->w_func = func;
+	w->w_data = data;
+	w->w_cpu = 0;
+	w->w_pending = 0;
+}
+
+/*
+ * Put W on WQ and wake the worker.
+ */
+static
+void
+workqueue_enqueue(struct workqueue *wq, struct work *w)
+{
+	spinlock_acquire(&wq->wq_lock);
+	w->w_next = NULL;
+	if (wq->wq_tail == NULL) {
+		wq->wq_head = w;
+	}
+	else {
+		wq->wq_tail->w_next = w;
+	}
+	wq->wq_tail = w;
+	wq->wq_nsubmit++;
+	wq->wq_depth++;
+	if (wq->wq_depth > wq->wq_maxdepth) {
+		wq->wq_maxdepth = wq->wq_depth;
+	}
+	wchan_wakeone(wq->wq_wchan);
+	spinlock_release(&wq->wq_lock);
+}
+
+/*
+ * Timer function for workqueue_submit_delayed.
+ */
+static
+void
+workqueue_timeout(void *data)
+{
+	struct work *w = data;
+
+	workqueue_enqueue(&workqueues[w->w_cpu], w);
+}
+
+/*
+ * Claiming w_pending with compare-and-swap settles races between
+ * cpus submitting the same item. If we migrate after reading curcpu
+ * the item just goes on the queue of the cpu we left.
+ */
+bool
+workqueue_submit(struct work *w)
+{
+	if (workqueues == NULL) {
+		KASSERT(!curthread->t_in_interrupt);
+		w->w_func(w->w_data);
+		return true;
+	}
+
+	if (!atomic_cas(&w->w_pending, 0, 1)) {
+		return false;
+	}
+	workqueue_enqueue(&workqueues[curcpu->c_number], w);
+	return true;
+}
+
+bool
+workqueue_submit_delayed(struct work *w, uint64_t delay)
+{
+	KASSERT(workqueues != NULL);
+
+	if (!atomic_cas(&w->w_pending, 0, 1)) {
+		return false;
+	}
+	w->w_cpu = curcpu->c_number;
+	timer_add(&w->w_timer, gettime_nsecs() + delay,
+		  workqueue_timeout, w);
+	return true;
+}
+
+void
+workqueue_flush(void)
+{
+	struct workqueue *wq;
+	unsigned i, target;
+
+	for (i=0; i<numworkqueues; i++) {
+		wq = &workqueues[i];
+		spinlock_acquire(&wq->wq_lock);
+		target = wq->wq_nsubmit;
+		while ((int)(wq->wq_ndone - target) < 0) {
+			wchan_lock(wq->wq_flushchan);
+			spinlock_release(&wq->wq_lock);
+			wchan_sleep(wq->wq_flushchan);
+			spinlock_acquire(&wq->wq_lock);
+		}
+		spinlock_release(&wq->wq_lock);
+	}
+}
+
+/*
+ * Worker thread for cpu CPUNUM's queue. It pins itself to that cpu,
+ * so work submitted there stays (cache-)local.
+ */
+static
+void
+workqueue_worker(void *data1, unsigned long cpunum)
+{
+	struct workqueue *wq = data1;
+	struct work *w;
+	void (*func)(void *);
+	void *data;
+
+	/* If this fails the worker just isn't pinned, which is fine. */
+	(void)thread_setaffinity(curthread, (uint32_t)1 << cpunum);
+
+	spinlock_acquire(&wq->wq_lock);
+	while (1) {
+		w = wq->wq_head;
+		if (w == NULL) {
+			wchan_lock(wq->wq_wchan);
+			spinlock_release(&wq->wq_lock);
+			wchan_sleep(wq->wq_wchan);
+			spinlock_acquire(&wq->wq_lock);
+			continue;
+		}
+		wq->wq_head = w->w_next;
+		if (wq->wq_head == NULL) {
+			wq->wq_tail = NULL;
+		}
+		wq->wq_depth--;
+		func = w->w_func;
+		data = w->w_data;
+		/* From here W belongs to its owner again. */
+		w->w_pending = 0;
+		spinlock_release(&wq->wq_lock);
+
+		func(data);
+
+		spinlock_acquire(&wq->wq_lock);
+		wq->wq_ndone++;
+		wchan_wakeall(wq->wq_flushchan);
+	}
+}
+
+void
+workqueue_bootstrap(void)
+{
+	struct workqueue *wq;
+	struct workqueue *wqs;
+	unsigned i, num;
+	char name[16];
+	int result;
+
+	num = thread_numcpus();
+	wqs = kmalloc(num * sizeof(*wqs));
+	if (wqs == NULL) {
+		panic("workqueue_bootstrap: Out of memory\n");
+	}
+	for (i=0; i<num; i++) {
+		wq = &wqs[i];
+		spinlock_init(&wq->wq_lock);
+		wq->wq_head = wq->wq_tail = NULL;
+		wq->wq_wchan = wchan_create("workqueue");
+		wq->wq_flushchan = wchan_create("wqflush");
+		if (wq->wq_wchan == NULL || wq->wq_flushchan == NULL) {
+			panic("workqueue_bootstrap: Out of memory\n");
+		}
+		wq->wq_nsubmit = wq->wq_ndone = 0;
+		wq->wq_depth = wq->wq_maxdepth = 0;
+	}
+	for (i=0; i<num; i++) {
+		snprintf(name, sizeof(name), "worker/%u", i);
+		result = thread_fork(name, NULL, workqueue_worker,
+				     &wqs[i], i);
+		if (result) {
+			panic("workqueue_bootstrap: thread_fork: %s\n",
+			      strerror(result));
+		}
+	}
+
+	/* Submits stop running inline only once the queues are ready. */
+	numworkqueues = num;
+	workqueues = wqs;
+}
+
+void
+workqueue_printstats(void)
+{
+	struct workqueue *wq;
+	unsigned i, nsubmit, ndone, depth, maxdepth;
+
+	kprintf("%3s %9s %9s %9s %9s\n",
+		"cpu", "submitted", "done", "depth", "maxdepth");
+	for (i=0; i<numworkqueues; i++) {
+		wq = &workqueues[i];
+		spinlock_acquire(&wq->wq_lock);
+		nsubmit = wq->wq_nsubmit;
+		ndone = wq->wq_ndone;
+		depth = wq->wq_depth;
+		maxdepth = wq->wq_maxdepth;
+		spinlock_release(&wq->wq_lock);
+		kprintf("%3u %9u %9u %9u %9u\n",
+			i, nsubmit, ndone, depth, maxdepth);
+	}
+}
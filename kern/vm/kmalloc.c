@@ -31,6 +31,11 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <vm.h>
+#include <shrinker.h>
+
+/* We define the real functions here; don't let lib.h rename them. */
+#undef kmalloc
+#undef kstrdup
 
 /*
  * Kernel malloc.
@@ -186,6 +191,15 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Number of completely free pages kept on each size's list instead of
+ * being handed straight back to the VM system, so that a free/alloc
+ * cycle at a page boundary doesn't bounce a page in and out. They are
+ * given back by the subpage shrinker when the page allocator is short.
+ */
+#define SUBPAGE_KEEPEMPTY 1
+static unsigned emptypages[NSIZES];
+
 ////////////////////////////////////////
 
 /*
@@ -195,7 +209,7 @@ static struct pageref *allbase;
  * OS/161 performance and scalability aren't super-critical.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock kmalloc_spinlock = SPINLOCK_TICKET_INITIALIZER;
 
 ////////////////////////////////////////
 
@@ -330,6 +344,346 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+////////////////////////////////////////
+//
+// Allocation-site accounting (kheapstats option).
+//
+// Each subpage block gets a small label in front of it recording the
+// tag it was charged to and the number of bytes the caller asked
+// for. The label is 8 bytes so the pointer handed back keeps the
+// alignment the block itself had. Note that the label counts against
+// the block size, so with this option on a request moves up a size
+// class slightly earlier than it otherwise would.
+//
+// Whole-page allocations can't carry a label: kernel stacks and the
+// like depend on getting page-aligned memory. Those are recorded in a
+// small side table instead, looked up by address at kfree time. (A
+// labelled subpage pointer is never page-aligned, so kfree can tell
+// the two apart.)
+//
+// Per tag we keep live bytes/blocks, the peak of live bytes, and
+// alloc/free counts. Per size class (plus one class for whole-page
+// allocations) we keep what was asked for against what was handed
+// out, which is where the internal fragmentation shows up: e.g. a
+// 1025-byte request occupies a 2048-byte block.
+//
+// All of it is protected by kmalloc_spinlock.
+//
+
+#if OPT_KHEAPSTATS
+
+struct kheap_label {
+	uint16_t kl_magic;		/* KHEAP_LABEL_MAGIC */
+	uint16_t kl_tag;		/* index into kheap_tags[] */
+	uint32_t kl_size;		/* bytes requested by the caller */
+};
+
+#define KHEAP_LABEL_MAGIC	0x6b6c	/* "kl" */
+#define KHEAP_LABEL_SIZE	sizeof(struct kheap_label)
+
+struct kheap_bigalloc {
+	vaddr_t kb_addr;		/* 0 if slot unused */
+	struct kheap_label kb_label;
+};
+
+/* Page allocations beyond this many in flight go unaccounted. */
+#define NKHEAPBIG 128
+static struct kheap_bigalloc kheap_bigallocs[NKHEAPBIG];
+static unsigned kheap_untracked;
+
+struct kheap_tag {
+	const char *kt_name;		/* tag string; NULL if slot unused */
+	size_t kt_livebytes;		/* bytes currently allocated */
+	size_t kt_peakbytes;		/* high-water mark of kt_livebytes */
+	unsigned kt_liveblocks;		/* blocks currently allocated */
+	unsigned kt_allocs;		/* total kmalloc calls */
+	unsigned kt_frees;		/* total kfree calls */
+};
+
+/* The last slot catches everything once the table fills up. */
+#define NKHEAPTAGS 64
+static struct kheap_tag kheap_tags[NKHEAPTAGS];
+
+struct kheap_class {
+	unsigned kc_liveblocks;		/* blocks currently allocated */
+	size_t kc_reqbytes;		/* bytes requested for those blocks */
+	size_t kc_blockbytes;		/* bytes actually used by them */
+	unsigned kc_allocs;		/* total allocations in this class */
+	size_t kc_maxreq;		/* largest request seen */
+};
+
+/* One per subpage size, plus one for multi-page allocations. */
+#define KHEAP_PAGECLASS NSIZES
+static struct kheap_class kheap_classes[NSIZES+1];
+
+static size_t kheap_livebytes, kheap_peakbytes;
+
+/*
+ * True if a request for SZ bytes is served with whole pages (and
+ * thus without an inline label): it wouldn't fit in the largest
+ * subpage block together with its label. kmalloc_tagged then calls
+ * alloc_kpages itself, since kmalloc_block only switches to pages
+ * at LARGEST_SUBPAGE_SIZE.
+ */
+#define KHEAP_ISBIG(sz)  ((sz) + KHEAP_LABEL_SIZE >= LARGEST_SUBPAGE_SIZE)
+
+/*
+ * Find (or create) the slot for TAG. Tags are usually __FILE__, so
+ * the same string may appear at different addresses in different
+ * translation units; compare contents after the cheap pointer check.
+ */
+static
+unsigned
+kheap_findtag(const char *tag)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (i=0; i<NKHEAPTAGS-1; i++) {
+		if (kheap_tags[i].kt_name == NULL) {
+			kheap_tags[i].kt_name = tag;
+			return i;
+		}
+		if (kheap_tags[i].kt_name == tag ||
+		    !strcmp(kheap_tags[i].kt_name, tag)) {
+			return i;
+		}
+	}
+	if (kheap_tags[i].kt_name == NULL) {
+		kheap_tags[i].kt_name = "(other)";
+	}
+	return i;
+}
+
+/*
+ * Size class a request of REQSIZE bytes ends up in, and the number of
+ * bytes it actually occupies. Must match kmalloc_tagged's choice.
+ */
+static
+unsigned
+kheap_sizeclass(size_t reqsize, size_t *blockbytes)
+{
+	unsigned i;
+
+	if (KHEAP_ISBIG(reqsize)) {
+		*blockbytes = DIVROUNDUP(reqsize, PAGE_SIZE) * PAGE_SIZE;
+		return KHEAP_PAGECLASS;
+	}
+	for (i=0; i<NSIZES; i++) {
+		if (reqsize + KHEAP_LABEL_SIZE <= sizes[i]) {
+			break;
+		}
+	}
+	KASSERT(i < NSIZES);
+	*blockbytes = sizes[i];
+	return i;
+}
+
+/*
+ * Charge an allocation of REQSIZE bytes to TAG and fill in its label.
+ */
+static
+void
+kheap_account_alloc(struct kheap_label *kl, size_t reqsize, const char *tag)
+{
+	struct kheap_tag *kt;
+	struct kheap_class *kc;
+	size_t blockbytes;
+	unsigned ix;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	ix = kheap_findtag(tag);
+	kl->kl_magic = KHEAP_LABEL_MAGIC;
+	kl->kl_tag = ix;
+	kl->kl_size = reqsize;
+
+	kt = &kheap_tags[ix];
+	kt->kt_livebytes += reqsize;
+	kt->kt_liveblocks++;
+	kt->kt_allocs++;
+	if (kt->kt_livebytes > kt->kt_peakbytes) {
+		kt->kt_peakbytes = kt->kt_livebytes;
+	}
+
+	kc = &kheap_classes[kheap_sizeclass(reqsize, &blockbytes)];
+	kc->kc_liveblocks++;
+	kc->kc_reqbytes += reqsize;
+	kc->kc_blockbytes += blockbytes;
+	kc->kc_allocs++;
+	if (reqsize > kc->kc_maxreq) {
+		kc->kc_maxreq = reqsize;
+	}
+
+	kheap_livebytes += reqsize;
+	if (kheap_livebytes > kheap_peakbytes) {
+		kheap_peakbytes = kheap_livebytes;
+	}
+}
+
+/*
+ * Undo kheap_account_alloc for the allocation described by KL.
+ */
+static
+void
+kheap_account_free(struct kheap_label *kl)
+{
+	struct kheap_tag *kt;
+	struct kheap_class *kc;
+	size_t blockbytes;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (kl->kl_magic != KHEAP_LABEL_MAGIC || kl->kl_tag >= NKHEAPTAGS) {
+		panic("kfree: block at %p has no heap label "
+		      "(double free or not from kmalloc?)\n", kl);
+	}
+
+	kt = &kheap_tags[kl->kl_tag];
+	KASSERT(kt->kt_liveblocks > 0);
+	KASSERT(kt->kt_livebytes >= kl->kl_size);
+	kt->kt_livebytes -= kl->kl_size;
+	kt->kt_liveblocks--;
+	kt->kt_frees++;
+
+	kc = &kheap_classes[kheap_sizeclass(kl->kl_size, &blockbytes)];
+	KASSERT(kc->kc_liveblocks > 0);
+	kc->kc_liveblocks--;
+	kc->kc_reqbytes -= kl->kl_size;
+	kc->kc_blockbytes -= blockbytes;
+
+	kheap_livebytes -= kl->kl_size;
+
+	/* so a second kfree of the same block is caught above */
+	kl->kl_magic = 0;
+}
+
+/*
+ * Print the tag table, biggest live consumer first. There are only
+ * NKHEAPTAGS entries, so a repeated scan for the next-largest is fine
+ * and needs no extra memory.
+ */
+static
+void
+kheap_printtags(void)
+{
+	uint32_t done[DIVROUNDUP(NKHEAPTAGS, 32)];
+	struct kheap_tag *kt;
+	const char *name, *slash;
+	unsigned i, best;
+	bool found;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (i=0; i<DIVROUNDUP(NKHEAPTAGS, 32); i++) {
+		done[i] = 0;
+	}
+
+	kprintf("Heap usage by tag: %lu bytes live, %lu bytes peak\n",
+		(unsigned long) kheap_livebytes,
+		(unsigned long) kheap_peakbytes);
+	kprintf("  %-24s %9s %7s %9s %8s %8s\n", "tag", "livebytes",
+		"blocks", "peakbytes", "allocs", "frees");
+
+	while (1) {
+		found = false;
+		best = 0;
+		for (i=0; i<NKHEAPTAGS; i++) {
+			kt = &kheap_tags[i];
+			if (kt->kt_name == NULL ||
+			    (done[i/32] & (1U << (i%32))) != 0) {
+				continue;
+			}
+			if (!found || kt->kt_livebytes >
+			    kheap_tags[best].kt_livebytes) {
+				best = i;
+				found = true;
+			}
+		}
+		if (!found) {
+			break;
+		}
+		done[best/32] |= 1U << (best%32);
+
+		kt = &kheap_tags[best];
+		/* Show only the last path component of __FILE__ tags. */
+		name = kt->kt_name;
+		slash = strrchr(name, '/');
+		if (slash != NULL) {
+			name = slash + 1;
+		}
+		kprintf("  %-24s %9lu %7u %9lu %8u %8u\n", name,
+			(unsigned long) kt->kt_livebytes, kt->kt_liveblocks,
+			(unsigned long) kt->kt_peakbytes,
+			kt->kt_allocs, kt->kt_frees);
+	}
+	if (kheap_untracked > 0) {
+		kprintf("  (%u page allocations not tracked; "
+			"raise NKHEAPBIG)\n", kheap_untracked);
+	}
+}
+
+/*
+ * Print the per-size-class table. "waste" is the internal
+ * fragmentation: block bytes handed out beyond what was asked for
+ * (labels included). "free" is the number of unused blocks sitting
+ * on partially used subpages of that size.
+ */
+static
+void
+kheap_printclasses(void)
+{
+	struct kheap_class *kc;
+	struct pageref *pr;
+	unsigned i, npages, nfree;
+	size_t waste;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	kprintf("Heap usage by size class:\n");
+	kprintf("  %5s %5s %6s %6s %9s %9s %9s %5s %7s\n", "size",
+		"pages", "live", "free", "reqbytes", "blkbytes", "waste",
+		"waste%", "maxreq");
+
+	for (i=0; i<=NSIZES; i++) {
+		kc = &kheap_classes[i];
+		if (kc->kc_allocs == 0) {
+			continue;
+		}
+
+		npages = nfree = 0;
+		if (i < NSIZES) {
+			for (pr = sizebases[i]; pr != NULL;
+			     pr = pr->next_samesize) {
+				npages++;
+				nfree += pr->nfree;
+			}
+		}
+		else {
+			npages = kc->kc_blockbytes / PAGE_SIZE;
+		}
+
+		waste = kc->kc_blockbytes - kc->kc_reqbytes;
+		if (i < NSIZES) {
+			kprintf("  %5lu ", (unsigned long) sizes[i]);
+		}
+		else {
+			kprintf("  %5s ", "page");
+		}
+		kprintf("%5u %6u %6u %9lu %9lu %9lu %5lu%% %7lu\n",
+			npages, kc->kc_liveblocks, nfree,
+			(unsigned long) kc->kc_reqbytes,
+			(unsigned long) kc->kc_blockbytes,
+			(unsigned long) waste,
+			(unsigned long) (kc->kc_blockbytes == 0 ? 0 :
+					 waste * 100 / kc->kc_blockbytes),
+			(unsigned long) kc->kc_maxreq);
+	}
+}
+
+#endif /* OPT_KHEAPSTATS */
+
 void
 kheap_printstats(void)
 {
@@ -344,6 +698,13 @@ kheap_printstats(void)
 		dumpsubpage(pr);
 	}
 
+#if OPT_KHEAPSTATS
+	kprintf("\n");
+	kheap_printtags();
+	kprintf("\n");
+	kheap_printclasses();
+#endif
+
 	spinlock_release(&kmalloc_spinlock);
 }
 
@@ -430,6 +791,11 @@ subpage_kmalloc(size_t sz)
 
 			retptr = fl;
 			fl = fl->next;
+			if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+				/* no longer an empty page */
+				KASSERT(emptypages[blktype] > 0);
+				emptypages[blktype]--;
+			}
 			pr->nfree--;
 
 			if (fl != NULL) {
@@ -504,6 +870,9 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
+	/* It's empty until doalloc takes the first block. */
+	emptypages[blktype]++;
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -574,7 +943,13 @@ subpage_kfree(void *ptr)
 	pr->nfree++;
 
 	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+	if (pr->nfree == PAGE_SIZE / sizes[blktype] &&
+	    emptypages[blktype] < SUBPAGE_KEEPEMPTY) {
+		/* Whole page is free; keep it around for next time. */
+		emptypages[blktype]++;
+		spinlock_release(&kmalloc_spinlock);
+	}
+	else if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
@@ -595,11 +970,61 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+/*
+ * Shrinker: give the kept empty pages back to the VM system.
+ */
+static
+unsigned
+subpage_shrink(void *data, unsigned npages)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+	int blktype;
+	unsigned got;
+
+	(void)data;
+
+	got = 0;
+	while (got < npages) {
+		spinlock_acquire(&kmalloc_spinlock);
+		for (pr = allbase; pr != NULL; pr = pr->next_all) {
+			blktype = PR_BLOCKTYPE(pr);
+			if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+				break;
+			}
+		}
+		if (pr == NULL) {
+			spinlock_release(&kmalloc_spinlock);
+			break;
+		}
+		prpage = PR_PAGEADDR(pr);
+		KASSERT(emptypages[blktype] > 0);
+		emptypages[blktype]--;
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		spinlock_release(&kmalloc_spinlock);
+
+		free_kpages(prpage);
+		got++;
+	}
+	return got;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
+void
+kheap_bootstrap(void)
+{
+	shrinker_register("kmalloc", subpage_shrink, NULL, 0);
+#if OPT_LOCKPROF
+	spinlock_profile(&kmalloc_spinlock, "kmalloc");
+#endif
+}
+
+static
 void *
-kmalloc(size_t sz)
+kmalloc_block(size_t sz)
 {
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
@@ -618,9 +1043,111 @@ kmalloc(size_t sz)
 	return subpage_kmalloc(sz);
 }
 
+#if OPT_KHEAPSTATS
+
+void *
+kmalloc_tagged(size_t sz, const char *tag)
+{
+	struct kheap_label *kl;
+	void *ptr;
+	unsigned i;
+
+	if (KHEAP_ISBIG(sz)) {
+		/*
+		 * Whole pages, even for the few sizes kmalloc_block
+		 * would still fit in a 2048-byte subpage block: such a
+		 * block can be page-aligned, and kheap_unlabel takes
+		 * any page-aligned pointer for one of these.
+		 */
+		ptr = (void *)alloc_kpages(DIVROUNDUP(sz, PAGE_SIZE));
+		if (ptr == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		for (i=0; i<NKHEAPBIG; i++) {
+			if (kheap_bigallocs[i].kb_addr == 0) {
+				kheap_bigallocs[i].kb_addr = (vaddr_t)ptr;
+				kheap_account_alloc(&kheap_bigallocs[i].kb_label,
+						    sz, tag);
+				break;
+			}
+		}
+		if (i == NKHEAPBIG) {
+			kheap_untracked++;
+		}
+		spinlock_release(&kmalloc_spinlock);
+		return ptr;
+	}
+
+	kl = kmalloc_block(sz + KHEAP_LABEL_SIZE);
+	if (kl == NULL) {
+		return NULL;
+	}
+	spinlock_acquire(&kmalloc_spinlock);
+	kheap_account_alloc(kl, sz, tag);
+	spinlock_release(&kmalloc_spinlock);
+	return kl + 1;
+}
+
+void *
+kmalloc(size_t sz)
+{
+	return kmalloc_tagged(sz, "(untagged)");
+}
+
+/*
+ * Drop the accounting for PTR and return the address of the block
+ * that actually needs to be freed.
+ */
+static
+void *
+kheap_unlabel(void *ptr)
+{
+	struct kheap_label *kl;
+	unsigned i;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if ((vaddr_t)ptr % PAGE_SIZE == 0) {
+		for (i=0; i<NKHEAPBIG; i++) {
+			if (kheap_bigallocs[i].kb_addr == (vaddr_t)ptr) {
+				kheap_account_free(&kheap_bigallocs[i].kb_label);
+				kheap_bigallocs[i].kb_addr = 0;
+				break;
+			}
+		}
+		if (i == NKHEAPBIG) {
+			KASSERT(kheap_untracked > 0);
+			kheap_untracked--;
+		}
+	}
+	else {
+		kl = (struct kheap_label *)ptr - 1;
+		kheap_account_free(kl);
+		ptr = kl;
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return ptr;
+}
+
+#else
+
+void *
+kmalloc(size_t sz)
+{
+	return kmalloc_block(sz);
+}
+
+#endif /* OPT_KHEAPSTATS */
+
 void
 kfree(void *ptr)
 {
+#if OPT_KHEAPSTATS
+	if (ptr != NULL) {
+		ptr = kheap_unlabel(ptr);
+	}
+#endif
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Shrinker registry: reclaim callbacks the page allocator runs
+ * before giving up on an allocation.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <current.h>
+#include <shrinker.h>
+
+#define MAXSHRINKERS 16
+
+struct shrinker {
+	const char *sh_name;
+	shrinker_func sh_func;
+	void *sh_data;
+	unsigned sh_flags;
+
+	/* statistics; updated under shrinker_lock */
+	unsigned sh_calls;
+	unsigned sh_pages;
+};
+
+/*
+ * Entries are only ever appended, and an entry is filled in under
+ * the lock before shrinker_count is bumped, so reclaim can read
+ * entries below the count without holding the lock while calling them.
+ */
+static struct shrinker shrinkers[MAXSHRINKERS];
+static unsigned shrinker_count;
+static unsigned shrinker_failures;
+static struct spinlock shrinker_lock = SPINLOCK_INITIALIZER;
+
+int
+shrinker_register(const char *name, shrinker_func func, void *data,
+		  unsigned flags)
+{
+	struct shrinker *sh;
+
+	KASSERT(name != NULL);
+	KASSERT(func != NULL);
+
+	spinlock_acquire(&shrinker_lock);
+	if (shrinker_count >= MAXSHRINKERS) {
+		spinlock_release(&shrinker_lock);
+		kprintf("shrinker: no room to register %s\n", name);
+		return ENOSPC;
+	}
+	sh = &shrinkers[shrinker_count];
+	sh->sh_name = name;
+	sh->sh_func = func;
+	sh->sh_data = data;
+	sh->sh_flags = flags;
+	sh->sh_calls = 0;
+	sh->sh_pages = 0;
+	shrinker_count++;
+	spinlock_release(&shrinker_lock);
+	return 0;
+}
+
+/*
+ * True if the current thread may block: it exists, isn't running an
+ * interrupt handler, and holds no spinlocks.
+ */
+static
+bool
+shrinker_cansleep(void)
+{
+	return curthread != NULL && !curthread->t_in_interrupt &&
+		curthread->t_iplhigh_count == 0;
+}
+
+unsigned
+shrinker_reclaim(unsigned npages)
+{
+	struct shrinker *sh;
+	unsigned i, count, got, total;
+	bool cansleep;
+
+	cansleep = shrinker_cansleep();
+
+	spinlock_acquire(&shrinker_lock);
+	count = shrinker_count;
+	spinlock_release(&shrinker_lock);
+
+	total = 0;
+	for (i=0; i<count && total < npages; i++) {
+		sh = &shrinkers[i];
+		if ((sh->sh_flags & SHRINK_MAYSLEEP) && !cansleep) {
+			continue;
+		}
+		got = sh->sh_func(sh->sh_data, npages - total);
+
+		spinlock_acquire(&shrinker_lock);
+		sh->sh_calls++;
+		sh->sh_pages += got;
+		spinlock_release(&shrinker_lock);
+
+		total += got;
+	}
+
+	if (total == 0) {
+		spinlock_acquire(&shrinker_lock);
+		shrinker_failures++;
+		spinlock_release(&shrinker_lock);
+	}
+	return total;
+}
+
+void
+shrinker_printstats(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&shrinker_lock);
+	kprintf("shrinkers: %u registered, %u passes freed nothing\n",
+		shrinker_count, shrinker_failures);
+	for (i=0; i<shrinker_count; i++) {
+		kprintf("    %-16s %s calls %u pages %u\n",
+			shrinkers[i].sh_name,
+			(shrinkers[i].sh_flags & SHRINK_MAYSLEEP) ?
+			"sleep " : "atomic",
+			shrinkers[i].sh_calls, shrinkers[i].sh_pages);
+	}
+	spinlock_release(&shrinker_lock);
+}
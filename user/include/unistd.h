@@ -42,6 +42,7 @@
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>	/* needs kern/time.h */
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -118,6 +119,7 @@
 __DEAD void _exit(int code);
 int execv(const char *prog, char *const *args);
 pid_t fork(void);
+pid_t vfork(void);
 int waitpid(pid_t pid, int *returncode, int flags);
 /* 
  * Open actually takes either two or three args: the optional third
@@ -153,15 +155,24 @@ int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
+int getrusage(int who, struct rusage *usage);
 int __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
+/* OS/161 extensions. */
+int settickets(pid_t pid, int tickets);
+int setaffinity(pid_t pid, unsigned cpumask);
+int __threadfork(void (*func)(void *), void *arg);
+__DEAD void __threadexit(void);
+
 /*
  * These are not themselves system calls, but wrapper routines in libc.
  */
 
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int threadfork(void (*func)(void));		/* calls __threadfork */
+__DEAD void threadexit(void);			/* calls __threadexit */
 
 #endif /* _UNISTD_H_ */
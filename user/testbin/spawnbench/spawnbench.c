@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * spawnbench - fork+exec+wait throughput.
+ *
+ * Usage: spawnbench [count [program]]
+ *
+ * Runs PROGRAM (default /bin/true) COUNT times (default 100) one
+ * after another, first starting it with fork and then with vfork,
+ * and prints how long each way took. The difference is the cost of
+ * copying and destroying the parent's address space that vfork
+ * skips.
+ *
+ * This should work once fork, vfork, execv, and waitpid are in.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+#define DEFCOUNT 100
+
+static
+unsigned long
+now_us(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long)secs * 1000000 + nsecs / 1000;
+}
+
+static
+void
+run(const char *how, int usevfork, int count, char **args)
+{
+	unsigned long start, us;
+	pid_t pid;
+	int i, status;
+
+	start = now_us();
+	for (i=0; i<count; i++) {
+		pid = usevfork ? vfork() : fork();
+		if (pid < 0) {
+			err(1, "%s", how);
+		}
+		if (pid == 0) {
+			/* child; after vfork, only exec or _exit are safe */
+			execv(args[0], args);
+			_exit(255);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "%s: %s failed (status %d)", how, args[0],
+			     status);
+		}
+	}
+	us = now_us() - start;
+
+	printf("%-6s %d spawns in %lu.%03lu s: %lu us each\n", how, count,
+	       us / 1000000, (us / 1000) % 1000, us / count);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char *defargs[] = { (char *)"/bin/true", NULL };
+	char **args;
+	int count;
+
+	count = DEFCOUNT;
+	args = defargs;
+	if (argc > 1) {
+		count = atoi(argv[1]);
+		if (count < 1) {
+			errx(1, "Usage: spawnbench [count [program]]");
+		}
+	}
+	if (argc > 2) {
+		args = argv + 2;
+	}
+
+	run("fork", 0, count, args);
+	run("vfork", 1, count, args);
+	return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * threadexit - check that _exit and execv end a process's other
+ * threads, wherever they are.
+ *
+ * Each case runs in a child process that starts some threads and
+ * then calls _exit or execv, and the parent checks the child's exit
+ * status and that it came back promptly:
+ *
+ *    blocked  - a sibling is asleep in waitpid for a process that
+ *               takes SLOWSECS seconds to exit.
+ *    spinning - a sibling loops in user mode, never making a
+ *               system call.
+ *    exec     - both of the above, then execv of /bin/true.
+ *
+ * This needs threadfork (see unistd.h) along with fork, execv and
+ * waitpid.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+#define SLOWSECS 5
+
+static pid_t slowpid;
+static volatile int waiting, spinning;
+
+static
+time_t
+now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return secs;
+}
+
+/* Wait (busily, as there's no sleep call) for SECS seconds. */
+static
+void
+pause_secs(time_t secs)
+{
+	time_t end;
+
+	end = now() + secs;
+	while (now() < end) {
+		/* nothing */
+	}
+}
+
+/* Start a process that exits after SLOWSECS. */
+static
+void
+start_slow(void)
+{
+	slowpid = fork();
+	if (slowpid < 0) {
+		err(1, "fork");
+	}
+	if (slowpid == 0) {
+		pause_secs(SLOWSECS);
+		_exit(0);
+	}
+}
+
+static
+void
+waiter(void)
+{
+	int status;
+
+	waiting = 1;
+	/* we shouldn't get past this */
+	waitpid(slowpid, &status, 0);
+	warnx("waiter: waitpid returned");
+}
+
+static
+void
+spinner(void)
+{
+	spinning = 1;
+	while (1) {
+		/* nothing */
+	}
+}
+
+static
+void
+startthread(void (*func)(void))
+{
+	if (threadfork(func) < 0) {
+		err(1, "threadfork");
+	}
+}
+
+static
+void
+case_blocked(void)
+{
+	start_slow();
+	startthread(waiter);
+	while (!waiting) {
+		/* nothing */
+	}
+	/* give it time to get to sleep in waitpid */
+	pause_secs(1);
+	_exit(3);
+}
+
+static
+void
+case_spinning(void)
+{
+	startthread(spinner);
+	while (!spinning) {
+		/* nothing */
+	}
+	_exit(4);
+}
+
+static
+void
+case_exec(void)
+{
+	char *args[2];
+
+	start_slow();
+	startthread(waiter);
+	startthread(spinner);
+	while (!waiting || !spinning) {
+		/* nothing */
+	}
+	pause_secs(1);
+	args[0] = (char *)"true";
+	args[1] = NULL;
+	execv("/bin/true", args);
+	warn("execv");
+	_exit(99);
+}
+
+static
+int
+run(const char *name, void (*func)(void), int expect)
+{
+	time_t start, secs;
+	pid_t pid;
+	int status;
+
+	start = now();
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		func();
+		_exit(98);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	secs = now() - start;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != expect) {
+		printf("%s: FAILED: status %d, expected exit(%d)\n",
+		       name, status, expect);
+		return 1;
+	}
+	if (secs >= SLOWSECS) {
+		printf("%s: FAILED: took %d seconds\n", name, (int)secs);
+		return 1;
+	}
+	printf("%s: passed\n", name);
+	return 0;
+}
+
+int
+main(void)
+{
+	int failures = 0;
+
+	failures += run("blocked", case_blocked, 3);
+	failures += run("spinning", case_spinning, 4);
+	failures += run("exec", case_exec, 0);
+
+	printf("threadexit: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
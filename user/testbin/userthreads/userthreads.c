@@ -40,7 +40,9 @@
  * "threadfork()" and passing the address for execution of the new
  * thread to begin at, (2) that if the parent thread exits any child
  * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
+ * return from the function they started in. For (2) the parent
+ * leaves with threadexit(): returning from main calls exit(), which
+ * ends the whole process, other threads included. If any or all of these
  * assumptions are not met by your user-level threads, you will need
  * to patch this test accordingly.
  *
@@ -80,7 +82,7 @@ main(int argc, char *argv[])
     }
 
     printf("Parent has left.\n");
-    return 0;
+    threadexit();
 }
 
 /* multiple threads will simply print out the global variable.
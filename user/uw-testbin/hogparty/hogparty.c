@@ -5,10 +5,25 @@
  *
  *   relies on fork, _exit, stdout and stderr, and execv
  *
+ *   "hogparty t1 t2 ..." instead starts one silent hog per argument,
+ *   gives it that many scheduler tickets with settickets, lets them all
+ *   spin for HOGSECS seconds and reports the share of a cpu each one
+ *   got next to the share its tickets entitle it to. Also relies on
+ *   waitpid, __time and settickets. Run it on a single cpu (or with
+ *   more hogs than cpus), or each hog just gets a cpu of its own.
+ *   Afterwards it prints the hogs' combined cpu time and context
+ *   switches from getrusage.
+ *
  */
 
 #include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <err.h>
+#include <sys/wait.h>
+
+#define HOGSECS 5
+#define MAXHOGS 8
 
 static char *xhargv[2] = { (char *)"xhog", NULL };
 static char *yhargv[2] = { (char *)"yhog", NULL };
@@ -32,9 +47,102 @@ spawnv(const char *prog, char **argv)
   }
 }
 
+static
+unsigned long
+now_ms(void)
+{
+  time_t secs;
+  unsigned long nsecs;
+
+  __time(&secs, &nsecs);
+  return (unsigned long)secs * 1000 + nsecs / 1000000;
+}
+
+/* spin until the clock reaches END; return how much work got done */
+static
+unsigned long
+spin_until(unsigned long end)
+{
+  unsigned long n = 0;
+  volatile int i;
+
+  while (now_ms() < end) {
+    for (i=0; i<1000; i++) {
+      /* nothing */
+    }
+    n++;
+  }
+  return n;
+}
+
+static
+void
+ticketparty(int nhogs, char **args)
+{
+  int tickets[MAXHOGS];
+  pid_t pids[MAXHOGS];
+  unsigned long solo, work, end;
+  int i, total, status, pct;
+  struct rusage ru;
+
+  total = 0;
+  for (i=0; i<nhogs; i++) {
+    tickets[i] = atoi(args[i]);
+    total += tickets[i];
+  }
+
+  /* how much work one hog gets done with a cpu to itself */
+  printf("hogparty: calibrating for %d seconds\n", HOGSECS);
+  solo = spin_until(now_ms() + HOGSECS*1000);
+  if (solo == 0) {
+    errx(1, "calibration did no work");
+  }
+
+  end = now_ms() + HOGSECS*1000;
+  for (i=0; i<nhogs; i++) {
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      err(1, "fork");
+    }
+    if (pids[i] == 0) {
+      if (settickets(0, tickets[i]) < 0) {
+	err(1, "settickets %d", tickets[i]);
+      }
+      work = spin_until(end);
+      /* report percent of a cpu; fits in an exit status */
+      pct = (int)(work * 100 / solo);
+      _exit(pct > 255 ? 255 : pct);
+    }
+  }
+
+  for (i=0; i<nhogs; i++) {
+    if (waitpid(pids[i], &status, 0) < 0) {
+      err(1, "waitpid");
+    }
+    printf("hog %d: %4d tickets, expected %3d%%, got %3d%%\n",
+	   i, tickets[i], tickets[i] * 100 / total, WEXITSTATUS(status));
+  }
+
+  if (getrusage(RUSAGE_CHILDREN, &ru) < 0) {
+    err(1, "getrusage");
+  }
+  printf("hogs: %lu.%03lu cpu seconds, %lu voluntary and %lu involuntary"
+	 " switches\n", (unsigned long)ru.ru_utime.tv_sec,
+	 (unsigned long)ru.ru_utime.tv_usec / 1000,
+	 (unsigned long)ru.ru_nvcsw, (unsigned long)ru.ru_nivcsw);
+}
+
 int
-main()
+main(int argc, char **argv)
 {
+  if (argc > 1) {
+    if (argc - 1 > MAXHOGS) {
+      errx(1, "at most %d hogs", MAXHOGS);
+    }
+    ticketparty(argc - 1, argv + 1);
+    return 0;
+  }
+
   spawnv("/uw-testbin/xhog", xhargv);
   spawnv("/uw-testbin/yhog", yhargv);
   spawnv("/uw-testbin/zhog", zhargv);